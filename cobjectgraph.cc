@@ -1,165 +1,4577 @@
 #include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include <functional>
 #include <sstream>
 #include <stdexcept>
+#include <algorithm>
 #include "cobjectgraph.h"
 
+#ifdef COG_WITH_ZLIB
+#include <zlib.h>
+#endif
+
 using namespace std;
 using namespace CObjectGraph;
 
-int BaseNode::counter = 1;
+DotWriter::DotWriter(ostream& os_, size_t buffer_size)
+    : os{&os_}, str{nullptr}, fd{-1}, bytes_flushed{0}, stream{this}
+{
+    Init(buffer_size);
+}
+
+DotWriter::DotWriter(int fd_, size_t buffer_size)
+    : os{nullptr}, str{nullptr}, fd{fd_}, bytes_flushed{0}, stream{this}
+{
+    Init(buffer_size);
+}
+
+DotWriter::DotWriter(string& str_, size_t buffer_size)
+    : os{nullptr}, str{&str_}, fd{-1}, bytes_flushed{0}, stream{this}
+{
+    Init(buffer_size);
+}
+
+DotWriter::~DotWriter()
+{
+    try
+    {
+        Flush();
+    }
+    catch (...)
+    {
+        // Call Flush() explicitly to observe write errors
+    }
+}
+
+void DotWriter::Init(size_t buffer_size)
+{
+    if (buffer_size == 0)
+        throw logic_error("DotWriter buffer size cannot be zero");
+    buffer.resize(buffer_size);
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+// Writes all n bytes, retrying short and interrupted writes
+static bool WriteAll(int fd, const char * s, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t written = ::write(fd, s, n);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        s += written;
+        n -= written;
+    }
+    return true;
+}
+
+void DotWriter::WriteToTarget(const char * s, size_t n)
+{
+    bytes_flushed += n;
+    if (os != nullptr)
+    {
+        os->write(s, n);
+        return;
+    }
+    if (str != nullptr)
+    {
+        str->append(s, n);
+        return;
+    }
+    if (!WriteAll(fd, s, n))
+        throw runtime_error("DotWriter: write failed");
+}
+
+void DotWriter::Flush()
+{
+    size_t n = pptr() - pbase();
+    if (n > 0)
+    {
+        setp(buffer.data(), buffer.data() + buffer.size());
+        WriteToTarget(buffer.data(), n);
+    }
+    if (os != nullptr)
+        os->flush();
+}
+
+DotWriter& DotWriter::Write(const char * s, size_t n)
+{
+    if (n <= (size_t)(epptr() - pptr()))
+    {
+        memcpy(pptr(), s, n);
+        pbump((int)n);
+        return *this;
+    }
+    Flush();
+    if (n >= buffer.size())
+    {
+        WriteToTarget(s, n);
+    }
+    else
+    {
+        memcpy(pptr(), s, n);
+        pbump((int)n);
+    }
+    return *this;
+}
+
+DotWriter& DotWriter::operator<<(char c)
+{
+    if (pptr() == epptr())
+        Flush();
+    *pptr() = c;
+    pbump(1);
+    return *this;
+}
+
+DotWriter& DotWriter::operator<<(long long x)
+{
+    char digits[24];
+    char * end = digits + sizeof(digits);
+    char * p = end;
+    unsigned long long u = (x < 0) ? 0ULL - (unsigned long long)x : (unsigned long long)x;
+    do
+    {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    if (x < 0)
+        *--p = '-';
+    return Write(p, end - p);
+}
+
+int DotWriter::overflow(int c)
+{
+    if (c != traits_type::eof())
+        *this << (char)c;
+    return traits_type::not_eof(c);
+}
+
+streamsize DotWriter::xsputn(const char * s, streamsize n)
+{
+    Write(s, (size_t)n);
+    return n;
+}
+
+int DotWriter::sync()
+{
+    Flush();
+    return 0;
+}
+
+
+#ifdef COG_WITH_ZLIB
+// Full chunks go to the compressing thread through a short queue and come
+// back empty to be reused, so memory stays bounded however much is written
+class GzipOstream::Buffer : public streambuf
+{
+    public:
+        Buffer(ostream& target_, int level, size_t chunk_size_);
+        ~Buffer();
+        void Close();
+
+    private:
+        static const size_t MAX_QUEUED = 4;
+
+        ostream& target;
+        size_t chunk_size;
+        z_stream zs;
+        vector< char > chunk;
+        vector< char > compressed;
+        mutex queue_mutex;
+        condition_variable changed;
+        deque< vector< char > > queue;
+        vector< vector< char > > free_chunks;
+        bool closing;
+        bool closed;
+        atomic< bool > failed;    // Set by the compressing thread
+        thread compressor;
+
+        void Submit();
+        void Compress();
+        void Deflate(const vector< char >& input, int flush);
+
+        int overflow(int c) override;
+        streamsize xsputn(const char * s, streamsize n) override;
+        int sync() override;
+};
+
+GzipOstream::Buffer::Buffer(ostream& target_, int level, size_t chunk_size_)
+    : target(target_), chunk_size{chunk_size_}, compressed(chunk_size_),
+      closing{false}, closed{false}, failed{false}
+{
+    if (chunk_size == 0)
+        throw logic_error("GzipOstream chunk size cannot be zero");
+    memset(&zs, 0, sizeof(zs));
+    // 15 + 16: the largest window, with a gzip header
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw runtime_error("Could not initialize zlib");
+    chunk.reserve(chunk_size);
+    compressor = thread(&Buffer::Compress, this);
+}
+
+GzipOstream::Buffer::~Buffer()
+{
+    try
+    {
+        Close();
+    }
+    catch (...)
+    {
+        // Close() reports errors; a destructor cannot
+    }
+}
+
+void GzipOstream::Buffer::Submit()
+{
+    unique_lock< mutex > lock(queue_mutex);
+    changed.wait(lock, [this] { return queue.size() < MAX_QUEUED; });
+    queue.push_back(std::move(chunk));
+    if (!free_chunks.empty())
+    {
+        chunk = std::move(free_chunks.back());
+        free_chunks.pop_back();
+    }
+    else
+    {
+        chunk = vector< char >();
+        chunk.reserve(chunk_size);
+    }
+    changed.notify_all();
+}
+
+void GzipOstream::Buffer::Compress()
+{
+    vector< char > input;
+    while (true)
+    {
+        {
+            unique_lock< mutex > lock(queue_mutex);
+            changed.wait(lock, [this] { return !queue.empty() || closing; });
+            if (queue.empty())
+                break;
+            input = std::move(queue.front());
+            queue.pop_front();
+            changed.notify_all();
+        }
+        if (!failed)
+            Deflate(input, Z_NO_FLUSH);
+        input.clear();
+        lock_guard< mutex > lock(queue_mutex);
+        free_chunks.push_back(std::move(input));
+    }
+    if (!failed)
+        Deflate(vector< char >(), Z_FINISH);
+}
+
+void GzipOstream::Buffer::Deflate(const vector< char >& input, int flush)
+{
+    zs.next_in = (Bytef *)input.data();
+    zs.avail_in = (uInt)input.size();
+    do
+    {
+        zs.next_out = (Bytef *)compressed.data();
+        zs.avail_out = (uInt)compressed.size();
+        int result = deflate(&zs, flush);
+        if (result == Z_STREAM_ERROR)
+        {
+            failed = true;
+            return;
+        }
+        target.write(compressed.data(), compressed.size() - zs.avail_out);
+        if (!target)
+        {
+            failed = true;
+            return;
+        }
+    } while (zs.avail_out == 0);
+}
+
+void GzipOstream::Buffer::Close()
+{
+    if (closed)
+        return;
+    closed = true;
+    if (!chunk.empty())
+        Submit();
+    {
+        lock_guard< mutex > lock(queue_mutex);
+        closing = true;
+        changed.notify_all();
+    }
+    compressor.join();
+    deflateEnd(&zs);
+    target.flush();
+    if (failed || !target)
+        throw runtime_error("Could not write the compressed output");
+}
+
+int GzipOstream::Buffer::overflow(int c)
+{
+    if (closed || failed)
+        return traits_type::eof();
+    if (c != traits_type::eof())
+    {
+        chunk.push_back((char)c);
+        if (chunk.size() >= chunk_size)
+            Submit();
+    }
+    return traits_type::not_eof(c);
+}
+
+streamsize GzipOstream::Buffer::xsputn(const char * s, streamsize n)
+{
+    if (closed || failed)
+        return 0;
+    streamsize left = n;
+    while (left > 0)
+    {
+        size_t room = chunk_size - chunk.size();
+        size_t count = min((size_t)left, room);
+        chunk.insert(chunk.end(), s, s + count);
+        s += count;
+        left -= count;
+        if (chunk.size() >= chunk_size)
+            Submit();
+    }
+    return n;
+}
+
+int GzipOstream::Buffer::sync()
+{
+    // Compression needs long inputs, so nothing is sent before the chunk is full
+    return (closed || failed) ? -1 : 0;
+}
+
+
+GzipOstream::GzipOstream(ostream& target, int level, size_t chunk_size)
+    : ostream(nullptr), buffer{new Buffer(target, level, chunk_size)}
+{
+    rdbuf(buffer.get());
+}
+
+GzipOstream::~GzipOstream()
+{
+}
+
+void GzipOstream::Close()
+{
+    flush();
+    buffer->Close();
+}
+#endif
+
+
+void * Arena::Allocate(size_t size, size_t alignment)
+{
+    size_t padding = (alignment - (reinterpret_cast<uintptr_t>(current) % alignment)) % alignment;
+    if (current == nullptr || padding + size > remaining)
+    {
+        // Oversized requests get a block of their own
+        size_t size_to_allocate = max(block_size, size + alignment);
+        blocks.push_back(unique_ptr<char[]>(new char[size_to_allocate]));
+        current = blocks.back().get();
+        remaining = size_to_allocate;
+        bytes_allocated += size_to_allocate;
+        padding = (alignment - (reinterpret_cast<uintptr_t>(current) % alignment)) % alignment;
+    }
+    void * p = current + padding;
+    current += padding + size;
+    remaining -= padding + size;
+    return p;
+}
+
+
+// FNV-1a
+static uint64_t HashBytes(const char * s, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; i++)
+    {
+        h ^= static_cast<unsigned char>(s[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+size_t StringPool::Hash::operator()(const char * s) const
+{
+    return HashBytes(s, strlen(s));
+}
+
+const char * StringPool::Intern(const string& str)
+{
+    auto f = strings.find(str.c_str());
+    if (f != strings.end())
+        return *f;
+
+    char * copy = static_cast<char *>(arena.Allocate(str.size() + 1, 1));
+    memcpy(copy, str.c_str(), str.size() + 1);
+    strings.insert(copy);
+    return copy;
+}
+
+
+const char * AttributeSet::Key(size_t i) const
+{
+    return pool.String(entries[i].key);
+}
+
+const char * AttributeSet::Value(size_t i) const
+{
+    return pool.String(entries[i].value);
+}
+
+size_t AttributePool::SetHash::operator()(const AttributeSet * set) const
+{
+    return (size_t)HashBytes(reinterpret_cast< const char * >(set->entries.data()),
+                             set->entries.size() * sizeof(AttributeSet::Entry));
+}
+
+bool AttributePool::SetEqual::operator()(const AttributeSet * a, const AttributeSet * b) const
+{
+    return a->entries.size() == b->entries.size()
+        && memcmp(a->entries.data(), b->entries.data(), a->entries.size() * sizeof(AttributeSet::Entry)) == 0;
+}
+
+size_t AttributePool::ChangeHash::operator()(const Change& c) const
+{
+    uint64_t h = (uint64_t)reinterpret_cast<uintptr_t>(c.set) * 0x9E3779B97F4A7C15ULL;
+    h ^= (((uint64_t)c.key << 32) | c.value) + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+    return (size_t)h;
+}
+
+AttributePool::AttributePool()
+    : arena{4096}, strings{arena}
+{
+    empty = Intern(vector< AttributeSet::Entry >());
+}
+
+size_t AttributePool::BytesAllocated() const
+{
+    return arena.BytesAllocated()
+        + strings_by_id.capacity() * sizeof(const char *)
+        + sets.size() * sizeof(AttributeSet);
+}
+
+uint32_t AttributePool::Id(const string& s)
+{
+    const char * interned = strings.Intern(s);
+    auto f = string_ids.emplace(interned, (uint32_t)strings_by_id.size());
+    if (f.second)
+        strings_by_id.push_back(interned);
+    return f.first->second;
+}
+
+const AttributeSet * AttributePool::Intern(vector< AttributeSet::Entry > entries)
+{
+    AttributeSet probe(*this, 0, std::move(entries));
+    auto f = set_index.find(&probe);
+    if (f != set_index.end())
+        return *f;
+    sets.emplace_back(*this, (uint32_t)sets.size(), std::move(probe.entries));
+    set_index.insert(&sets.back());
+    return &sets.back();
+}
+
+const AttributeSet * AttributePool::With(const AttributeSet * set, const string& key, const string& value)
+{
+    lock_guard< mutex > lock(pool_mutex);
+    Change change { set, Id(key), Id(value) };
+    // Nodes of one type tend to make the same calls, so most land here
+    auto f = changes.find(change);
+    if (f != changes.end())
+        return f->second;
+
+    vector< AttributeSet::Entry > entries = set->entries;
+    auto e = find_if(entries.begin(), entries.end(), [&change] (const AttributeSet::Entry& x) {
+        return x.key == change.key;
+    });
+    if (e != entries.end())
+        e->value = change.value;
+    else
+        entries.push_back(AttributeSet::Entry { change.key, change.value });
+    const AttributeSet * result = Intern(std::move(entries));
+    changes.emplace(change, result);
+    return result;
+}
+
+uint32_t AttributePool::With(uint32_t set_id, const string& key, const string& value)
+{
+    const AttributeSet * set;
+    {
+        // Another thread may be adding sets
+        lock_guard< mutex > lock(pool_mutex);
+        set = &sets[set_id];
+    }
+    return With(set, key, value)->Id();
+}
+
+
+uint32_t NodeTable::AddRow(uint32_t id, const void * object)
+{
+    objects.push_back(object);
+    positions.push_back(Position());
+    attribute_sets.push_back(attribute_pool.Empty()->Id());
+    ids.push_back(id);
+    return (uint32_t)ids.size() - 1;
+}
+
+uint32_t NodeTable::AddRow(uint32_t id, const NodeTable& from, uint32_t row)
+{
+    objects.push_back(from.objects[row]);
+    positions.push_back(from.positions[row]);
+    attribute_sets.push_back(from.attribute_sets[row]);
+    ids.push_back(id);
+    return (uint32_t)ids.size() - 1;
+}
+
+size_t NodeTable::Shard(const void * object)
+{
+    uint64_t h = (uint64_t)reinterpret_cast<uintptr_t>(object) * 0x9E3779B97F4A7C15ULL;
+    return (h >> 32) % INDEX_SHARDS;
+}
+
+size_t NodeTable::BytesAllocated() const
+{
+    // Hash indexes are not counted, as elsewhere in Graph::MemoryUsed
+    return objects.capacity() * sizeof(const void *)
+        + positions.capacity() * sizeof(Position)
+        + (attribute_sets.capacity() + ids.capacity()) * sizeof(uint32_t);
+}
+
+NodeTable& NodeTables::For(const void * type)
+{
+    NodeTable * table = Find(type);
+    if (table != nullptr)
+        return *table;
+    tables.push_back(unique_ptr< NodeTable >(new NodeTable(type, (uint32_t)tables.size(), attribute_pool)));
+    by_type.emplace(type, tables.back().get());
+    last = tables.back().get();
+    return *last;
+}
+
+NodeTable * NodeTables::Find(const void * type) const
+{
+    if (last != nullptr && last->Type() == type)
+        return last;
+    auto f = by_type.find(type);
+    if (f == by_type.end())
+        return nullptr;
+    last = f->second;
+    return last;
+}
+
+size_t NodeTables::BytesAllocated() const
+{
+    size_t bytes = 0;
+    for (const auto& table : tables)
+        bytes += sizeof(NodeTable) + table->BytesAllocated();
+    return bytes;
+}
+
+
+string BaseNode::GetName() const
+{
+    return "node" + to_string(this->id);
+}
+
+void BaseNode::WriteDot(DotWriter& out, const vector<Attribute> * extra, uint32_t print_id)
+{
+    WriteDotLabel(out, print_id);
+    const AttributeSet * attributes = table->Attributes(row);
+    for (size_t i = 0; i < attributes->Size(); i++)
+        out << ", " << attributes->Key(i) << "=\"" << attributes->Value(i) << '"';
+    if (extra != nullptr)
+        for (const auto& a : *extra)
+            out << ", " << a.key << "=\"" << a.value << '"';
+    out << ']';
+}
+
+void BaseNode::WriteDotLabel(DotWriter& out, uint32_t print_id)
+{
+    WriteName(out, (print_id != 0) ? print_id : id);
+    out << " [label=\"";
+    if (label_is_fields)
+    {
+        LabelFormatGuard guard(out.Stream());
+        WriteLabelFields(out.Stream(), label);
+    }
+    else if (label != nullptr)
+    {
+        out << label;
+    }
+    else
+    {
+        LabelFormatGuard guard(out.Stream());
+        WriteLabel(out.Stream());
+    }
+    out << '"';
+
+    const Position& pos = table->positions[row];
+    if (pos.IsSet())
+    {
+        out << ", pos=\"";
+        pos.WriteDot(out);
+        out << '"';
+    }
+}
+
+void BaseNode::SetAttribute(string key, string value)
+{
+    if (key == "label" || key == "pos")
+        throw logic_error("label and pos attributes cannot be set this way!");
+    table->attribute_sets[row] = table->Pool().With(table->attribute_sets[row], key, value);
+}
+
+
+FrontierNode::FrontierNode(uint32_t id, NodeTable& table, string what_)
+    : BaseNode(id, &TypeTag<FrontierNode>::id, table, nullptr), count{0}, what{what_}, linked{false}
+{
+    SetAttribute("shape", "none");
+}
+
+void FrontierNode::WriteLabel(ostream& oss)
+{
+    oss << "... " << count << " more";
+    if (!what.empty())
+        oss << ' ' << what;
+}
+
+
+Edge::Edge(const BaseNode * from, const BaseNode * to, const char * label)
+{
+    this->from = from->GetId();
+    this->to = to->GetId();
+    this->label = label;
+}
+
+void Edge::WriteDot(DotWriter& out, const char * style, const char * default_label, uint32_t weight) const
+{
+    BaseNode::WriteName(out, this->from);
+    out << " -> ";
+    BaseNode::WriteName(out, this->to);
+    const char * separator = " [";
+    if (this->label != default_label)
+    {
+        out << separator << "label=\"" << this->label << "\"";
+        separator = ", ";
+    }
+    if (weight != 1)
+    {
+        out << separator << "weight=" << weight;
+        separator = ", ";
+    }
+    if (style != nullptr)
+    {
+        out << separator << style;
+        separator = ", ";
+    }
+    if (separator[0] == ',')
+        out << "]";
+}
+
+
+namespace CObjectGraph
+{
+    // Edge and rank endpoints recorded during a parallel build are resolved
+    // once it is over. Those given by object are looked up then: with
+    // separate_node_for_each_null_object, which null node a lookup finds
+    // depends on the serial numbering.
+    struct Endpoint
+    {
+        const BaseNode * node;
+        const void * object;
+        const void * type;
+    };
+
+    struct LoggedEdge
+    {
+        Endpoint from;
+        Endpoint to;
+        string label;
+        size_t added_mark;      // The worker's added.size() when it was made
+    };
+
+    struct BuildWorker;
+
+    // What one AddRelatedObjects call did during a parallel build, as ranges
+    // of the expanding worker's records. Replaying the logs in serial
+    // traversal order gives the serial node numbering and edge order.
+    struct ExpansionLog
+    {
+        BaseNode * node;
+        BuildWorker * worker;
+        size_t added_begin, added_end;
+        size_t edges_begin, edges_end;
+        size_t ranks_begin, ranks_end;
+        uint32_t next_id;       // The serial build's next id when it began
+    };
+
+    struct BuildWorker
+    {
+        explicit BuildWorker(AttributePool& attribute_pool) : rows(attribute_pool) { }
+
+        ParallelBuild * build;
+        Arena * arena;
+        // Rows of the nodes this worker creates, moved to the graph's
+        // tables when the build is merged
+        NodeTables rows;
+        // The graph's tables this worker has used, for their object indexes
+        unordered_map< const void *, NodeTable * > index_tables;
+        mutex queue_mutex;
+        deque< BaseNode * > queue;      // Owner pops the back, thieves the front
+        vector< ExpansionLog > logs;
+        vector< BaseNode * > added;     // Every node AddNode returned, in call order
+        vector< uint32_t > next_ids;    // The serial build's next id after each added
+        vector< LoggedEdge > edges;
+        vector< pair< Endpoint, Endpoint > > ranks;
+        vector< BaseNode * > created;
+        vector< BaseNode * > null_nodes;
+    };
+
+    struct ParallelBuild
+    {
+        explicit ParallelBuild(size_t shards) : shard_mutexes(shards) { }
+
+        Graph * graph;
+        vector< mutex > shard_mutexes;  // One per NodeTable index shard
+        mutex tables_mutex;             // Guards adding the graph's tables
+        vector< unique_ptr< BuildWorker > > workers;
+        atomic< uint32_t > next_id;
+        atomic< size_t > outstanding;   // Nodes queued or being expanded
+        atomic< size_t > queued;        // Nodes in the worker queues
+        atomic< bool > failed;
+        mutex error_mutex;
+        exception_ptr error;
+
+        // Workers with nothing to expand wait on work_changed, which is
+        // notified when a node is queued, the last one is expanded or the
+        // build fails
+        mutex idle_mutex;
+        condition_variable work_changed;
+        atomic< size_t > idle;
+
+        void NotifyQueued()
+        {
+            queued++;
+            if (idle > 0)
+            {
+                lock_guard< mutex > lock(idle_mutex);
+                work_changed.notify_one();
+            }
+        }
+
+        void NotifyAll()
+        {
+            lock_guard< mutex > lock(idle_mutex);
+            work_changed.notify_all();
+        }
+    };
+}
+
+// The worker the current thread is running, if any
+static thread_local BuildWorker * current_worker = nullptr;
+
+static BuildWorker * WorkerFor(const Graph * graph)
+{
+    if (current_worker != nullptr && current_worker->build->graph == graph)
+        return current_worker;
+    return nullptr;
+}
+
+
+Graph::~Graph()
+{
+    // The memory itself is released by the arena
+    for (auto node : nodes)
+        if (node != nullptr)
+            node->~BaseNode();
+}
+
+size_t Graph::MemoryUsed() const
+{
+    size_t bytes = arena.BytesAllocated() + attribute_pool.BytesAllocated();
+    for (const auto& a : thread_arenas)
+        bytes += a->BytesAllocated();
+    return bytes
+        + tables.BytesAllocated()
+        + nodes.capacity() * sizeof(BaseNode *)
+        + slots.capacity() * sizeof(NodeSlot)
+        + edges.capacity() * sizeof(Edge)
+        + edge_weights.capacity() * sizeof(uint32_t)
+        + (rank_parent.capacity() + rank_size.capacity()) * sizeof(uint32_t);
+}
+
+NodeTable * Graph::IndexTable(const void * type, bool add)
+{
+    BuildWorker * worker = WorkerFor(this);
+    if (worker == nullptr)
+        return add ? &tables.For(type) : tables.Find(type);
+
+    // Tables are rarely added, so each worker remembers the ones it found
+    auto f = worker->index_tables.find(type);
+    if (f != worker->index_tables.end())
+        return f->second;
+    lock_guard< mutex > lock(build->tables_mutex);
+    NodeTable * table = add ? &tables.For(type) : tables.Find(type);
+    if (table != nullptr)
+        worker->index_tables.emplace(type, table);
+    return table;
+}
+
+BaseNode * Graph::FindNodeForObject(const void * object, const void * type)
+{
+    size_t shard = NodeTable::Shard(object);
+    BaseNode * node = nullptr;
+    if (type != nullptr)
+    {
+        NodeTable * table = IndexTable(type, false);
+        if (table != nullptr)
+        {
+            unique_lock< mutex > lock;
+            if (WorkerFor(this) != nullptr)
+                lock = unique_lock< mutex >(build->shard_mutexes[shard]);
+            auto f = table->by_object[shard].find(object);
+            if (f != table->by_object[shard].end())
+                node = f->second;
+        }
+    }
+    else
+    {
+        // The lowest-id node of any type; graphs have few types
+        unique_lock< mutex > tables_lock, lock;
+        if (WorkerFor(this) != nullptr)
+        {
+            tables_lock = unique_lock< mutex >(build->tables_mutex);
+            lock = unique_lock< mutex >(build->shard_mutexes[shard]);
+        }
+        for (size_t i = 0; i < tables.Size(); i++)
+        {
+            auto f = tables[i].by_object[shard].find(object);
+            if (f != tables[i].by_object[shard].end() && (node == nullptr || f->second->id < node->id))
+                node = f->second;
+        }
+    }
+    if (node != nullptr)
+        return node;
+    // Objects left out by a traversal limit are represented by the frontier
+    if (frontier != nullptr && deferred_objects.count(object) != 0)
+        return frontier;
+    return nullptr;
+}
+
+BaseNode * Graph::FindNodeForEndpoint(const void * object, const void * type)
+{
+    BaseNode * node = FindNodeForObject(object, type);
+    if (node == nullptr && type != nullptr)
+        node = FindNodeForObject(object, nullptr);
+    return node;
+}
+
+void Graph::IndexNode(const void * object, BaseNode * node)
+{
+    // Only the first node of each type is indexed, as with separate null
+    // nodes. Build workers hold the shard's lock.
+    IndexTable(node->type, true)->by_object[NodeTable::Shard(object)].emplace(object, node);
+}
+
+void Graph::UnindexNode(BaseNode * node)
+{
+    const void * object = node->table->objects[node->row];
+    NodeTable * table = tables.Find(node->type);
+    if (table == nullptr)
+        return;
+    auto& shard = table->by_object[NodeTable::Shard(object)];
+    auto f = shard.find(object);
+    if (f != shard.end() && f->second == node)
+        shard.erase(f);
+}
+
+bool Graph::HasLimits() const
+{
+    return max_depth != 0 || max_nodes != 0 || max_edges != 0;
+}
+
+bool Graph::AtLimit() const
+{
+    // Roots are always added
+    if (expanding_node == nullptr)
+        return false;
+    if (max_depth != 0 && expanding_node->depth >= max_depth)
+        return true;
+    return max_nodes != 0 && nodes.size() - frontier_count - removed_count >= max_nodes;
+}
+
+BaseNode * Graph::DeferObject(const void * object)
+{
+    if (frontier == nullptr)
+    {
+        frontier = arena.New< FrontierNode >((uint32_t)nodes.size() + 1, tables.For(&TypeTag<FrontierNode>::id));
+        frontier->depth = expanding_node->depth + 1;
+        AppendNode(frontier);
+        frontier_count++;
+    }
+    bool separate = (object == nullptr && separate_node_for_each_null_object);
+    if (deferred_objects.insert(object).second || separate)
+        frontier->Add();
+    return frontier;
+}
+
+BaseNode * Graph::AddNodeIfNotFound(const void * object, const void * type, const NodeFactory& factory,
+                                    bool set_pos, int x, int y)
+{
+    bool separate = (object == nullptr && separate_node_for_each_null_object);
+    BuildWorker * worker = WorkerFor(this);
+    if (worker != nullptr)
+    {
+        // Parallel build: claim the object under its index shard's lock
+        BaseNode * node = nullptr;
+        bool created = false;
+        size_t shard = NodeTable::Shard(object);
+        NodeTable * table = IndexTable(type, true);
+        {
+            lock_guard< mutex > lock(build->shard_mutexes[shard]);
+            auto& index = table->by_object[shard];
+            auto f = index.find(object);
+            if (f != index.end() && !separate)
+                node = f->second;
+            if (node == nullptr)
+            {
+                node = factory.Create(*worker->arena, worker->rows.For(type), build->next_id++);
+                index.emplace(object, node);
+                created = true;
+            }
+        }
+
+        if (created)
+        {
+            worker->created.push_back(node);
+            if (object == nullptr)
+                worker->null_nodes.push_back(node);
+            if (set_pos)
+                node->SetPosition(x, y);
+            if (object != nullptr)
+            {
+                build->outstanding++;
+                {
+                    lock_guard< mutex > lock(worker->queue_mutex);
+                    worker->queue.push_back(node);
+                }
+                build->NotifyQueued();
+            }
+        }
+        worker->added.push_back(node);
+        return node;
+    }
+
+    BaseNode * node = FindNodeForObject(object, type);
+    if (node == nullptr || separate)
+    {
+        if (separate && next_null_node < reusable_null_nodes.size())
+        {
+            node = reusable_null_nodes[next_null_node++];
+        }
+        else if (AtLimit())
+        {
+            node = DeferObject(object);
+        }
+        else
+        {
+            node = factory.Create(arena, tables.For(type), (uint32_t)nodes.size() + 1);
+            node->depth = (expanding_node != nullptr) ? expanding_node->depth + 1 : 0;
+            AppendNode(node);
+            IndexNode(object, node);
+
+            if (set_pos)
+                node->SetPosition(x, y);
+
+            if (object != nullptr)
+            {
+                pending.push_back(node);
+                ExpandPendingNodes();
+            }
+        }
+    }
+
+    if (incremental)
+    {
+        if (expanding_node != nullptr)
+            CurrentRecord().children.push_back(node);
+        else if (find(roots.begin(), roots.end(), node) == roots.end())
+            roots.push_back(node);
+    }
+    if (capture_labels != LabelCapture::NONE && !expanding)
+        CaptureLabels(false);
+    return node;
+}
+
+void Graph::AppendNode(BaseNode * node)
+{
+    nodes.push_back(node);
+    slots.push_back(NodeSlot { node->table->Index(), node->row });
+    if (incremental)
+        records.push_back(ExpansionRecord { 0, {}, {}, {}, {} });
+}
+
+Graph::ExpansionRecord& Graph::CurrentRecord()
+{
+    return (expanding_node != nullptr) ? records[expanding_node->id - 1] : top_level;
+}
+
+void Graph::AddEdge(const BaseNode * from, const BaseNode * to, string label)
+{
+    if (from == nullptr)
+    {
+        throw runtime_error("from cannot be null");
+    }
+    if (to == nullptr)
+    {
+        throw runtime_error("to cannot be null");
+    }
+    BuildWorker * worker = WorkerFor(this);
+    if (worker != nullptr)
+    {
+        worker->edges.push_back(LoggedEdge { {from, nullptr, nullptr}, {to, nullptr, nullptr}, label,
+                                             worker->added.size() });
+        return;
+    }
+
+    if (frontier != nullptr && to == frontier)
+    {
+        // One unlabeled edge leads to the objects a limit left out
+        if (frontier->linked || from == frontier)
+            return;
+        frontier->linked = true;
+        label = "";
+    }
+    Edge e(from, to, strings.Intern(label));
+    // A duplicate that is merged adds no edge, so it does not count
+    if (max_edges != 0 && edges.size() >= max_edges && !IsDuplicateEdge(e))
+    {
+        if (edge_frontier == nullptr)
+        {
+            edge_frontier = arena.New< FrontierNode >((uint32_t)nodes.size() + 1, tables.For(&TypeTag<FrontierNode>::id),
+                                                      "edges");
+            AppendNode(edge_frontier);
+            frontier_count++;
+        }
+        edge_frontier->Add();
+        return;
+    }
+
+    if (incremental)
+    {
+        ExpansionRecord& record = CurrentRecord();
+        record.edges.push_back(e);
+        record.edge_order.push_back(next_edge_order++);
+    }
+    // A refresh rebuilds the edge list from the records when it is done
+    if (!refreshing)
+        AppendEdge(e);
+}
+
+size_t Graph::EdgeIndexKeyHash::operator()(const EdgeIndexKey& k) const
+{
+    uint64_t h = (((uint64_t)k.from << 32) | k.to) * 0x9E3779B97F4A7C15ULL;
+    h ^= (uint64_t)reinterpret_cast<uintptr_t>(k.label) + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+    return (size_t)h;
+}
+
+void Graph::AppendEdge(const Edge& e)
+{
+    if (duplicate_edges == DuplicateEdges::KEEP)
+    {
+        edges.push_back(e);
+        return;
+    }
+    auto inserted = edge_index.emplace(EdgeIndexKey { e.From(), e.To(), e.Label() }, (uint32_t)edges.size());
+    if (!inserted.second)
+    {
+        if (duplicate_edges == DuplicateEdges::COUNT)
+            edge_weights[inserted.first->second]++;
+        return;
+    }
+    edges.push_back(e);
+    if (duplicate_edges == DuplicateEdges::COUNT)
+        edge_weights.push_back(1);
+}
+
+bool Graph::IsDuplicateEdge(const Edge& e) const
+{
+    return duplicate_edges != DuplicateEdges::KEEP
+        && edge_index.count(EdgeIndexKey { e.From(), e.To(), e.Label() }) != 0;
+}
+
+void Graph::AddEdge(const void * fromObject, const void * fromType, const void * toObject, const void * toType,
+                    string label)
+{
+    // Looked up when the parallel build is merged
+    BuildWorker * worker = WorkerFor(this);
+    if (worker != nullptr)
+    {
+        worker->edges.push_back(LoggedEdge { {nullptr, fromObject, fromType}, {nullptr, toObject, toType}, label,
+                                             worker->added.size() });
+        return;
+    }
+    const BaseNode * from = FindNodeForObject(fromObject, fromType);
+    const BaseNode * to   = FindNodeForObject(toObject, toType);
+    if ((from == nullptr || to == nullptr) && expanding)
+    {
+        // The object may be queued for a node that has not been expanded
+        // yet, or get a node of its exact type later
+        deferred_links.push_back(DeferredLink { expanding_node, nullptr, fromObject, fromType, toObject, toType, label, false });
+        return;
+    }
+    if (from == nullptr)
+        from = FindNodeForEndpoint(fromObject, fromType);
+    if (to == nullptr)
+        to = FindNodeForEndpoint(toObject, toType);
+    if (from == nullptr)
+    {
+        throw runtime_error("Could not find the node for fromObject");
+    }
+    if (to == nullptr)
+    {
+        throw runtime_error("Could not find the node for toObject");
+    }
+    AddEdge(from, to, label);
+}
+
+void Graph::SetSameRank(const BaseNode * obj1Node, const BaseNode * obj2Node)
+{
+    if (obj1Node == nullptr)
+    {
+        throw runtime_error("obj1Node cannot be null");
+    }
+    if (obj2Node == nullptr)
+    {
+        throw runtime_error("obj2Node cannot be null");
+    }
+    BuildWorker * worker = WorkerFor(this);
+    if (worker != nullptr)
+    {
+        worker->ranks.push_back(make_pair(Endpoint {obj1Node, nullptr, nullptr}, Endpoint {obj2Node, nullptr, nullptr}));
+        return;
+    }
+    if (obj1Node == obj2Node && obj1Node == frontier)
+        return;
+    if (incremental)
+        CurrentRecord().ranks.push_back(make_pair(obj1Node->GetId(), obj2Node->GetId()));
+    if (refreshing)
+        return;
+    JoinRanks(obj1Node->GetId(), obj2Node->GetId());
+}
+
+void Graph::SetSameRank(const void * obj1, const void * obj1Type, const void * obj2, const void * obj2Type)
+{
+    BuildWorker * worker = WorkerFor(this);
+    if (worker != nullptr)
+    {
+        worker->ranks.push_back(make_pair(Endpoint {nullptr, obj1, obj1Type}, Endpoint {nullptr, obj2, obj2Type}));
+        return;
+    }
+    BaseNode * obj1Node = FindNodeForObject(obj1, obj1Type);
+    BaseNode * obj2Node = FindNodeForObject(obj2, obj2Type);
+    if ((obj1Node == nullptr || obj2Node == nullptr) && expanding)
+    {
+        deferred_links.push_back(DeferredLink { expanding_node, nullptr, obj1, obj1Type, obj2, obj2Type, "", true });
+        return;
+    }
+    if (obj1Node == nullptr)
+        obj1Node = FindNodeForEndpoint(obj1, obj1Type);
+    if (obj2Node == nullptr)
+        obj2Node = FindNodeForEndpoint(obj2, obj2Type);
+    if (obj1Node == nullptr)
+    {
+        throw runtime_error("Could not find the node for obj1");
+    }
+    if (obj2Node == nullptr)
+    {
+        throw runtime_error("Could not find the node for obj2");
+    }
+    SetSameRank(obj1Node, obj2Node);
+}
+
+void Graph::SetAttribute(AttributeScope scope, std::string key, std::string value)
+{
+    if (scope == AttributeScope::SPECIFIC_NODE)
+        throw logic_error("Cannot set a node-specific attribute on Graph!");
+    set_attribute(attributes, key, value, scope);
+}
+
+void Graph::SetTraversalOrder(TraversalOrder order)
+{
+    if (expanding)
+        throw logic_error("Cannot change the traversal order while nodes are being added!");
+    traversal_order = order;
+}
+
+void Graph::SetBuildThreads(unsigned threads)
+{
+    if (expanding)
+        throw logic_error("Cannot change the number of build threads while nodes are being added!");
+    build_threads = max(threads, 1u);
+}
+
+void Graph::SetMaxDepth(unsigned depth)
+{
+    if (expanding)
+        throw logic_error("Cannot change traversal limits while nodes are being added!");
+    max_depth = depth;
+}
+
+void Graph::SetMaxNodes(size_t count)
+{
+    if (expanding)
+        throw logic_error("Cannot change traversal limits while nodes are being added!");
+    max_nodes = count;
+}
+
+void Graph::SetMaxEdges(size_t count)
+{
+    if (expanding)
+        throw logic_error("Cannot change traversal limits while nodes are being added!");
+    max_edges = count;
+}
+
+void Graph::SetMaxOutputBytes(size_t bytes)
+{
+    max_output_bytes = bytes;
+}
+
+void Graph::SetIncremental(bool enabled)
+{
+    if (!nodes.empty())
+        throw logic_error("Incremental snapshots must be enabled before adding nodes!");
+    incremental = enabled;
+}
+
+void Graph::SetCaptureLabels(bool enabled)
+{
+    SetCaptureLabels(enabled ? LabelCapture::TEXT : LabelCapture::NONE);
+}
+
+void Graph::SetCaptureLabels(LabelCapture mode)
+{
+    if (!nodes.empty())
+        throw logic_error("Label capture must be enabled before adding nodes!");
+    capture_labels = mode;
+}
+
+void Graph::SetFoldDefaults(bool enabled)
+{
+    fold_defaults = enabled;
+}
+
+void Graph::SetDuplicateEdges(DuplicateEdges mode)
+{
+    if (!edges.empty())
+        throw logic_error("Cannot change how duplicate edges are handled after edges have been added!");
+    duplicate_edges = mode;
+}
+
+void Graph::CaptureLabels(bool all)
+{
+    // Frontier nodes have no capturer, as their labels do not depend on
+    // the objects
+    captured_rows.resize(tables.Size(), 0);
+    for (size_t i = 0; i < tables.Size(); i++)
+    {
+        NodeTable& table = tables[i];
+        if (table.capture_labels != nullptr)
+            table.capture_labels(*this, table, all ? 0 : captured_rows[i]);
+        captured_rows[i] = table.Size();
+    }
+}
+
+void Graph::WriteLabelFields()
+{
+    if (!fields_pending)
+        return;
+
+    // Each thread writes the labels of a contiguous range of nodes into an
+    // arena of its own
+    const size_t MIN_NODES_PER_THREAD = 4096;
+    size_t threads = min< size_t >(build_threads, max< size_t >(nodes.size() / MIN_NODES_PER_THREAD, 1));
+    while (thread_arenas.size() + 1 < threads)
+        thread_arenas.push_back(unique_ptr<Arena>(new Arena()));
+
+    vector< exception_ptr > errors(threads);
+    auto write_range = [this, threads, &errors](size_t t)
+    {
+        try
+        {
+            Arena& out = (t == 0) ? arena : *thread_arenas[t - 1];
+            ostringstream oss;
+            size_t end = nodes.size() * (t + 1) / threads;
+            for (size_t i = nodes.size() * t / threads; i < end; i++)
+            {
+                BaseNode * node = nodes[i];
+                if (node == nullptr || !node->label_is_fields)
+                    continue;
+                oss.str("");
+                {
+                    LabelFormatGuard guard(oss);
+                    node->WriteLabelFields(oss, node->label);
+                }
+                const string& text = oss.str();
+                char * label = (char *)out.Allocate(text.size() + 1, 1);
+                memcpy(label, text.c_str(), text.size() + 1);
+                node->label = label;
+                node->label_is_fields = false;
+            }
+        }
+        catch (...)
+        {
+            errors[t] = current_exception();
+        }
+    };
+
+    vector< thread > workers;
+    try
+    {
+        for (size_t t = 1; t < threads; t++)
+            workers.push_back(thread(write_range, t));
+    }
+    catch (...)
+    {
+        for (auto& w : workers)
+            w.join();
+        throw;
+    }
+    // The calling thread takes the first range
+    write_range(0);
+    for (auto& w : workers)
+        w.join();
+    for (const auto& e : errors)
+        if (e)
+            rethrow_exception(e);
+    fields_pending = false;
+}
+
+void Graph::WriteLabel(BaseNode * node, ostream& os)
+{
+    LabelFormatGuard guard(os);
+    if (node->label_is_fields)
+        node->WriteLabelFields(os, node->label);
+    else if (node->label != nullptr)
+        os << node->label;
+    else
+        node->WriteLabel(os);
+}
+
+uint64_t Graph::NodeVersion(BaseNode * node)
+{
+    uint64_t version = node->ObjectVersion();
+    if (version != 0)
+        return version;
+
+    // No version hook: fall back to a hash of the label
+    ostringstream oss;
+    node->WriteLabel(oss);
+    string label = oss.str();
+    return HashBytes(label.data(), label.size());
+}
+
+static bool EdgeLess(const Edge& a, const Edge& b)
+{
+    if (a.From() != b.From())
+        return a.From() < b.From();
+    if (a.To() != b.To())
+        return a.To() < b.To();
+    return a.Label() < b.Label();   // Labels are interned
+}
+
+static void DiffEdges(vector< Edge > before, vector< Edge > after, ChangeSet& changes)
+{
+    sort(before.begin(), before.end(), EdgeLess);
+    sort(after.begin(), after.end(), EdgeLess);
+    vector< Edge > diff;
+    set_difference(after.begin(), after.end(), before.begin(), before.end(), back_inserter(diff), EdgeLess);
+    for (const auto& e : diff)
+        changes.added_edges.push_back(EdgeChange { e.From(), e.To(), e.Label() });
+    diff.clear();
+    set_difference(before.begin(), before.end(), after.begin(), after.end(), back_inserter(diff), EdgeLess);
+    for (const auto& e : diff)
+        changes.removed_edges.push_back(EdgeChange { e.From(), e.To(), e.Label() });
+}
+
+// Gives the edges a node has again after a refresh the order they were
+// first added in, so they keep their place in the output. Edges it did not
+// have before keep the order they were given as they were added, after all
+// the others.
+static void KeepEdgeOrder(const vector< Edge >& before, const vector< uint64_t >& before_order,
+                          const vector< Edge >& after, vector< uint64_t >& after_order)
+{
+    // Equal edges are matched in order
+    auto by_edge = [](const vector< Edge >& edges)
+    {
+        vector< uint32_t > sorted(edges.size());
+        for (size_t i = 0; i < sorted.size(); i++)
+            sorted[i] = (uint32_t)i;
+        stable_sort(sorted.begin(), sorted.end(), [&edges](uint32_t a, uint32_t b) {
+            return EdgeLess(edges[a], edges[b]);
+        });
+        return sorted;
+    };
+    vector< uint32_t > old_edges = by_edge(before), new_edges = by_edge(after);
+    size_t i = 0, j = 0;
+    while (i < old_edges.size() && j < new_edges.size())
+    {
+        const Edge& a = before[old_edges[i]];
+        const Edge& b = after[new_edges[j]];
+        if (EdgeLess(a, b))
+        {
+            i++;
+        }
+        else if (EdgeLess(b, a))
+        {
+            j++;
+        }
+        else
+        {
+            after_order[new_edges[j]] = before_order[old_edges[i]];
+            i++;
+            j++;
+        }
+    }
+}
+
+ChangeSet Graph::Refresh()
+{
+    if (!incremental)
+        throw logic_error("Refresh needs SetIncremental(true) before the graph is built!");
+    if (expanding)
+        throw logic_error("Cannot refresh while nodes are being added!");
+
+    ChangeSet changes;
+    size_t old_count = nodes.size();
+    vector< bool > visited(old_count, false);
+    deque< BaseNode * > work;
+    // The edges of the nodes expanded again, compared once deferred links
+    // have been made
+    struct OldEdges
+    {
+        uint32_t id;
+        vector< Edge > edges;
+        vector< uint64_t > order;
+    };
+    vector< OldEdges > old_edges;
+    for (auto root : roots)
+    {
+        visited[root->id - 1] = true;
+        work.push_back(root);
+    }
+
+    expanding = true;
+    refreshing = true;
+    try
+    {
+        while (!work.empty())
+        {
+            BaseNode * node;
+            if (traversal_order == TraversalOrder::BREADTH_FIRST)
+            {
+                node = work.front();
+                work.pop_front();
+            }
+            else
+            {
+                node = work.back();
+                work.pop_back();
+            }
+            // Null and frontier nodes have nothing to expand
+            if (node->GetObject() == nullptr)
+                continue;
+
+            uint32_t id = node->id;
+            bool is_new = id > old_count;
+            uint64_t version = node->ObjectVersion();
+            if (is_new || version == 0 || version != records[id - 1].version)
+            {
+                if (version == 0)
+                    version = NodeVersion(node);
+                if (!is_new && version != records[id - 1].version)
+                    changes.changed_nodes.push_back(id);
+
+                old_edges.push_back(OldEdges { id, {}, {} });
+                old_edges.back().edges.swap(records[id - 1].edges);
+                old_edges.back().order.swap(records[id - 1].edge_order);
+                if (separate_node_for_each_null_object)
+                {
+                    for (auto child : records[id - 1].children)
+                        if (child->GetObject() == nullptr && dynamic_cast< FrontierNode * >(child) == nullptr)
+                            reusable_null_nodes.push_back(child);
+                    next_null_node = 0;
+                }
+                records[id - 1].children.clear();
+                records[id - 1].ranks.clear();
+                records[id - 1].version = version;
+                node->label = nullptr;
+                node->label_is_fields = false;
+
+                size_t links_mark = deferred_links.size();
+                expanding_node = node;
+                frontier = nullptr;
+                node->ExpandRelatedObjects(this);
+                SetLinkFrontiers(links_mark);
+                expanding_node = nullptr;
+                frontier = nullptr;
+                deferred_objects.clear();
+                reusable_null_nodes.clear();
+                // New nodes are reached through the record like the others
+                pending.clear();
+            }
+
+            visited.resize(nodes.size(), false);
+            size_t mark = work.size();
+            for (auto child : records[id - 1].children)
+            {
+                if (!visited[child->id - 1])
+                {
+                    visited[child->id - 1] = true;
+                    work.push_back(child);
+                }
+            }
+            if (traversal_order == TraversalOrder::DEPTH_FIRST)
+                reverse(work.begin() + mark, work.end());
+        }
+        ResolveDeferredLinks();
+        for (const auto& old : old_edges)
+        {
+            ExpansionRecord& record = records[old.id - 1];
+            DiffEdges(old.edges, record.edges, changes);
+            KeepEdgeOrder(old.edges, old.order, record.edges, record.edge_order);
+        }
+    }
+    catch (...)
+    {
+        pending.clear();
+        expanding_node = nullptr;
+        frontier = nullptr;
+        deferred_objects.clear();
+        deferred_links.clear();
+        reusable_null_nodes.clear();
+        refreshing = false;
+        expanding = false;
+        RebuildEdgesFromRecords();
+        throw;
+    }
+    refreshing = false;
+    expanding = false;
+
+    for (size_t i = old_count; i < nodes.size(); i++)
+        changes.added_nodes.push_back(i + 1);
+    for (size_t i = 0; i < old_count; i++)
+        if (nodes[i] != nullptr && !visited[i] && nodes[i] != edge_frontier)
+            RemoveNode(nodes[i], changes);
+
+    // Edges made outside any expansion may lead to removed nodes
+    auto& top = top_level.edges;
+    size_t kept = 0;
+    for (size_t i = 0; i < top.size(); i++)
+    {
+        if (nodes[top[i].From() - 1] == nullptr || nodes[top[i].To() - 1] == nullptr)
+        {
+            changes.removed_edges.push_back(EdgeChange { top[i].From(), top[i].To(), top[i].Label() });
+        }
+        else
+        {
+            top[kept] = top[i];
+            top_level.edge_order[kept++] = top_level.edge_order[i];
+        }
+    }
+    top.erase(top.begin() + kept, top.end());
+    top_level.edge_order.resize(kept);
+
+    RebuildEdgesFromRecords();
+    if (capture_labels != LabelCapture::NONE)
+        CaptureLabels(true);
+    return changes;
+}
+
+void Graph::RemoveNode(BaseNode * node, ChangeSet& changes)
+{
+    uint32_t id = node->id;
+    changes.removed_nodes.push_back(id);
+    for (const auto& e : records[id - 1].edges)
+        changes.removed_edges.push_back(EdgeChange { e.From(), e.To(), e.Label() });
+
+    if (node->GetObject() != nullptr || dynamic_cast< FrontierNode * >(node) == nullptr)
+    {
+        UnindexNode(node);
+        removed_count++;
+    }
+    else
+    {
+        frontier_count--;
+    }
+
+    // Its row and memory stay until the graph is destroyed
+    node->table->ids[node->row] = 0;
+    node->~BaseNode();
+    nodes[id - 1] = nullptr;
+    records[id - 1] = ExpansionRecord { 0, {}, {}, {}, {} };
+}
+
+void Graph::RebuildEdgesFromRecords()
+{
+    // Edges and rank groups whose nodes have been removed are dropped
+    auto alive = [this] (uint32_t a, uint32_t b) {
+        return nodes[a - 1] != nullptr && nodes[b - 1] != nullptr;
+    };
+    edges.clear();
+    edge_index.clear();
+    edge_weights.clear();
+    rank_parent.clear();
+    rank_size.clear();
+    // The edges are put back in the order they were first added, as that
+    // is where a build that did not refresh has them
+    vector< pair< uint64_t, const Edge * > > ordered;
+    for (size_t i = 0; i <= records.size(); i++)
+    {
+        const ExpansionRecord& record = (i == 0) ? top_level : records[i - 1];
+        if (i > 0 && nodes[i - 1] == nullptr)
+            continue;
+        for (size_t k = 0; k < record.edges.size(); k++)
+            if (alive(record.edges[k].From(), record.edges[k].To()))
+                ordered.push_back(make_pair(record.edge_order[k], &record.edges[k]));
+        for (const auto& r : record.ranks)
+            if (alive(r.first, r.second))
+                JoinRanks(r.first, r.second);
+    }
+    sort(ordered.begin(), ordered.end());
+    for (const auto& e : ordered)
+        AppendEdge(*e.second);
+}
+
+void Graph::JoinRanks(uint32_t id1, uint32_t id2)
+{
+    uint32_t needed = max(id1, id2);
+    if (rank_parent.size() < needed)
+    {
+        for (uint32_t i = (uint32_t)rank_parent.size(); i < needed; i++)
+            rank_parent.push_back(i);
+        rank_size.resize(needed, 1);
+    }
+    uint32_t a = RankRoot(id1 - 1), b = RankRoot(id2 - 1);
+    if (a == b)
+        return;
+    if (rank_size[a] < rank_size[b])
+        swap(a, b);
+    rank_parent[b] = a;
+    rank_size[a] += rank_size[b];
+}
+
+uint32_t Graph::RankRoot(uint32_t index)
+{
+    if (index >= rank_parent.size())
+        return index;
+    // Path halving
+    while (rank_parent[index] != index)
+    {
+        rank_parent[index] = rank_parent[rank_parent[index]];
+        index = rank_parent[index];
+    }
+    return index;
+}
+
+void Graph::RankGroups(vector< uint32_t >& members, vector< uint32_t >& begin)
+{
+    members.clear();
+    begin.clear();
+    // Groups are numbered as their lowest id is reached, then filled by a
+    // counting sort, which keeps the ids of each group in order
+    const uint32_t NONE = UINT32_MAX;
+    size_t n = rank_parent.size();
+    vector< uint32_t > group_of_root(n, NONE), group(n, NONE);
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t root = RankRoot((uint32_t)i);
+        if (rank_size[root] < 2)
+            continue;
+        if (group_of_root[root] == NONE)
+        {
+            group_of_root[root] = (uint32_t)begin.size();
+            begin.push_back(0);
+        }
+        group[i] = group_of_root[root];
+        begin[group[i]]++;
+    }
+    uint32_t offset = 0;
+    for (auto& b : begin)
+    {
+        uint32_t count = b;
+        b = offset;
+        offset += count;
+    }
+    begin.push_back(offset);
+    members.resize(offset);
+    vector< uint32_t > fill(begin.begin(), begin.end() - 1);
+    for (size_t i = 0; i < n; i++)
+        if (group[i] != NONE)
+            members[fill[group[i]]++] = (uint32_t)i + 1;
+}
+
+void Graph::ExpandPendingNodes()
+{
+    // AddNode calls made by AddRelatedObjects only queue the new nodes; the
+    // outermost call drains the work list.
+    if (expanding)
+        return;
+
+    if (build_threads > 1 && !HasLimits() && !incremental)
+    {
+        BaseNode * root = pending.back();
+        pending.clear();
+        ExpandInParallel(root);
+        return;
+    }
+
+    expanding = true;
+    try
+    {
+        while (!pending.empty())
+        {
+            BaseNode * node;
+            if (traversal_order == TraversalOrder::BREADTH_FIRST)
+            {
+                node = pending.front();
+                pending.pop_front();
+            }
+            else
+            {
+                node = pending.back();
+                pending.pop_back();
+            }
+
+            size_t mark = pending.size();
+            if (incremental)
+                records[node->id - 1].version = NodeVersion(node);
+            size_t links_mark = deferred_links.size();
+            expanding_node = node;
+            frontier = nullptr;
+            node->ExpandRelatedObjects(this);
+            SetLinkFrontiers(links_mark);
+            expanding_node = nullptr;
+            frontier = nullptr;
+            deferred_objects.clear();
+            // Visit the objects found by this node in the order they were added
+            if (traversal_order == TraversalOrder::DEPTH_FIRST)
+                reverse(pending.begin() + mark, pending.end());
+        }
+        ResolveDeferredLinks();
+    }
+    catch (...)
+    {
+        pending.clear();
+        expanding_node = nullptr;
+        frontier = nullptr;
+        deferred_objects.clear();
+        deferred_links.clear();
+        expanding = false;
+        throw;
+    }
+    expanding = false;
+}
+
+void Graph::SetLinkFrontiers(size_t mark)
+{
+    for (size_t i = mark; i < deferred_links.size(); i++)
+        deferred_links[i].frontier = frontier;
+}
+
+bool Graph::LeftObjectsOut() const
+{
+    // The edge frontier stands for edges, not objects
+    return frontier_count > (edge_frontier != nullptr ? 1u : 0u);
+}
+
+void Graph::ResolveDeferredLinks()
+{
+    // Each link is made as if by the expansion that asked for it
+    vector< DeferredLink > links;
+    links.swap(deferred_links);
+    BaseNode * last_node = nullptr;
+    for (auto& link : links)
+    {
+        BaseNode * from = FindNodeForEndpoint(link.from, link.from_type);
+        BaseNode * to = FindNodeForEndpoint(link.to, link.to_type);
+        bool left_out = LeftObjectsOut();
+        if (from == nullptr && !left_out)
+            throw runtime_error(link.rank ? "Could not find the node for obj1" : "Could not find the node for fromObject");
+        if (to == nullptr && !left_out)
+            throw runtime_error(link.rank ? "Could not find the node for obj2" : "Could not find the node for toObject");
+        expanding_node = link.node;
+        if (link.node != last_node)
+            deferred_objects.clear();
+        last_node = link.node;
+        frontier = link.frontier;
+        if (from == nullptr || to == nullptr)
+        {
+            // An object without a node was left out by a limit somewhere
+            // along the way; the asking node's frontier counts it
+            FrontierNode * had = frontier;
+            if (from == nullptr)
+                from = DeferObject(link.from);
+            if (to == nullptr)
+                to = DeferObject(link.to);
+            if (had == nullptr)
+            {
+                for (auto& other : links)
+                    if (other.node == link.node)
+                        other.frontier = frontier;
+                if (incremental)
+                    CurrentRecord().children.push_back(frontier);
+            }
+        }
+        if (link.rank)
+            SetSameRank(from, to);
+        else
+            AddEdge(from, to, link.label);
+    }
+    expanding_node = nullptr;
+    frontier = nullptr;
+    deferred_objects.clear();
+}
+
+void Graph::ExpandInParallel(BaseNode * root)
+{
+    ParallelBuild state(NodeTable::INDEX_SHARDS);
+    state.graph = this;
+    state.next_id = root->GetId() + 1;
+    state.outstanding = 1;
+    state.queued = 1;
+    state.idle = 0;
+    state.failed = false;
+
+    while (thread_arenas.size() + 1 < build_threads)
+        thread_arenas.push_back(unique_ptr<Arena>(new Arena()));
+    for (unsigned i = 0; i < build_threads; i++)
+    {
+        state.workers.push_back(unique_ptr<BuildWorker>(new BuildWorker(attribute_pool)));
+        state.workers[i]->build = &state;
+        state.workers[i]->arena = (i == 0) ? &arena : thread_arenas[i - 1].get();
+    }
+    state.workers[0]->queue.push_back(root);
+
+    expanding = true;
+    build = &state;
+    vector< thread > threads;
+    try
+    {
+        for (unsigned i = 1; i < build_threads; i++)
+            threads.push_back(thread(&Graph::RunBuildWorker, this, ref(state), i));
+    }
+    catch (...)
+    {
+        state.failed = true;
+        state.NotifyAll();
+        lock_guard< mutex > lock(state.error_mutex);
+        state.error = current_exception();
+    }
+    // The calling thread is worker 0
+    RunBuildWorker(state, 0);
+    for (auto& t : threads)
+        t.join();
+    build = nullptr;
+    expanding = false;
+
+    if (state.error)
+    {
+        // Drop everything this build created; the root stays, as it would
+        // after a failed serial build
+        for (const auto& w : state.workers)
+            for (auto node : w->created)
+                UnindexNode(node);
+        for (const auto& w : state.workers)
+            for (auto node : w->created)
+                node->~BaseNode();
+        rethrow_exception(state.error);
+    }
+    MergeParallelBuild(state, root);
+}
+
+void Graph::RunBuildWorker(ParallelBuild& state, size_t index)
+{
+    BuildWorker& self = *state.workers[index];
+    current_worker = &self;
+    while (!state.failed && state.outstanding > 0)
+    {
+        BaseNode * node = nullptr;
+        {
+            lock_guard< mutex > lock(self.queue_mutex);
+            if (!self.queue.empty())
+            {
+                node = self.queue.back();
+                self.queue.pop_back();
+                state.queued--;
+            }
+        }
+        for (size_t i = 1; node == nullptr && i < state.workers.size(); i++)
+        {
+            BuildWorker& victim = *state.workers[(index + i) % state.workers.size()];
+            lock_guard< mutex > lock(victim.queue_mutex);
+            if (!victim.queue.empty())
+            {
+                node = victim.queue.front();
+                victim.queue.pop_front();
+                state.queued--;
+            }
+        }
+        if (node == nullptr)
+        {
+            unique_lock< mutex > lock(state.idle_mutex);
+            state.idle++;
+            state.work_changed.wait(lock, [&state] { return state.failed || state.outstanding == 0 || state.queued > 0; });
+            state.idle--;
+            continue;
+        }
+
+        ExpansionLog log;
+        log.node = node;
+        log.worker = &self;
+        log.added_begin = self.added.size();
+        log.edges_begin = self.edges.size();
+        log.ranks_begin = self.ranks.size();
+        try
+        {
+            node->ExpandRelatedObjects(this);
+        }
+        catch (...)
+        {
+            lock_guard< mutex > lock(state.error_mutex);
+            if (!state.error)
+                state.error = current_exception();
+            state.failed = true;
+            state.NotifyAll();
+        }
+        log.added_end = self.added.size();
+        log.edges_end = self.edges.size();
+        log.ranks_end = self.ranks.size();
+        self.logs.push_back(log);
+        if (--state.outstanding == 0)
+            state.NotifyAll();
+    }
+    current_worker = nullptr;
+}
+
+void Graph::MergeParallelBuild(ParallelBuild& state, BaseNode * root)
+{
+    // Nodes carry temporary ids in [base, next_id) in the order they were
+    // claimed. Replay the expansions the way ExpandPendingNodes would have
+    // run them to assign the ids a serial build gives.
+    uint32_t base = root->GetId();
+    size_t count = state.next_id - base;
+    vector< ExpansionLog * > logs(count, nullptr);
+    vector< BaseNode * > claimed(count, nullptr);
+    vector< uint32_t > new_ids(count, 0);
+    claimed[0] = root;
+    new_ids[0] = base;
+    for (const auto& w : state.workers)
+    {
+        for (auto& log : w->logs)
+            logs[log.node->GetId() - base] = &log;
+        for (auto node : w->created)
+            claimed[node->GetId() - base] = node;
+    }
+
+    vector< ExpansionLog * > expansion_order;
+    deque< BaseNode * > order;
+    order.push_back(root);
+    uint32_t next_id = base + 1;
+    while (!order.empty())
+    {
+        BaseNode * node;
+        if (traversal_order == TraversalOrder::BREADTH_FIRST)
+        {
+            node = order.front();
+            order.pop_front();
+        }
+        else
+        {
+            node = order.back();
+            order.pop_back();
+        }
+
+        ExpansionLog * log = logs[node->GetId() - base];
+        expansion_order.push_back(log);
+        log->next_id = next_id;
+        vector< uint32_t >& next_ids = log->worker->next_ids;
+        next_ids.resize(log->worker->added.size());
+        size_t mark = order.size();
+        for (size_t i = log->added_begin; i < log->added_end; i++)
+        {
+            BaseNode * added = log->worker->added[i];
+            size_t offset = added->GetId() - base;
+            // Nodes that existed before this build are skipped
+            if (added->GetId() >= base && new_ids[offset] == 0)
+            {
+                new_ids[offset] = next_id++;
+                // Rows move to the graph's tables in id order
+                NodeTable& table = tables.For(added->type);
+                added->row = table.AddRow(new_ids[offset], *added->table, added->row);
+                if (table.capture_labels == nullptr)
+                    table.capture_labels = added->table->capture_labels;
+                added->table = &table;
+                AppendNode(added);
+                if (logs[offset] != nullptr)
+                    order.push_back(added);
+            }
+            next_ids[i] = next_id;
+        }
+        if (traversal_order == TraversalOrder::DEPTH_FIRST)
+            reverse(order.begin() + mark, order.end());
+    }
+    if (next_id - base != count)
+        throw logic_error("Parallel build did not reach every node it created");
+
+    for (size_t i = 1; i < count; i++)
+        claimed[i]->id = new_ids[i];
+
+    // Null objects may have several nodes; a serial build indexes the first
+    // one of each type
+    for (const auto& w : state.workers)
+    {
+        for (auto node : w->null_nodes)
+        {
+            BaseNode *& first = tables.For(node->type).by_object[NodeTable::Shard(nullptr)][nullptr];
+            if (first->id > node->id)
+                first = node;
+        }
+    }
+
+    auto resolve = [this] (const Endpoint& e, const char * what) {
+        const BaseNode * node = (e.node != nullptr) ? e.node : FindNodeForEndpoint(e.object, e.type);
+        if (node == nullptr)
+            throw runtime_error(string("Could not find the node for ") + what);
+        return node;
+    };
+    // An edge by object to a node a serial build would not have had yet is
+    // deferred, as ResolveDeferredLinks would have done
+    vector< const LoggedEdge * > deferred;
+    for (auto log : expansion_order)
+    {
+        for (size_t i = log->edges_begin; i < log->edges_end; i++)
+        {
+            const LoggedEdge& e = log->worker->edges[i];
+            uint32_t next = (e.added_mark > log->added_begin) ? log->worker->next_ids[e.added_mark - 1] : log->next_id;
+            auto existed = [this, next] (const Endpoint& end) {
+                if (end.node != nullptr)
+                    return end.node;
+                const BaseNode * node = FindNodeForObject(end.object, end.type);
+                return (node != nullptr && node->GetId() < next) ? node : nullptr;
+            };
+            const BaseNode * from = existed(e.from);
+            const BaseNode * to = existed(e.to);
+            if (from == nullptr || to == nullptr)
+                deferred.push_back(&e);
+            else
+                AppendEdge(Edge(from, to, strings.Intern(e.label)));
+        }
+        for (size_t i = log->ranks_begin; i < log->ranks_end; i++)
+        {
+            const auto& r = log->worker->ranks[i];
+            JoinRanks(resolve(r.first, "obj1")->GetId(), resolve(r.second, "obj2")->GetId());
+        }
+    }
+    for (auto e : deferred)
+        AppendEdge(Edge(resolve(e->from, "fromObject"), resolve(e->to, "toObject"), strings.Intern(e->label)));
+}
+
+// Elements per run formatted by one thread, and how many runs per thread
+// may wait to be written
+static const size_t FORMAT_CHUNK_SIZE = 8192;
+static const size_t FORMAT_CHUNKS_PER_THREAD = 4;
+
+// Formats elements [0, count) in runs of FORMAT_CHUNK_SIZE on threads
+// threads, and has the calling thread write the runs' text in order. Runs
+// are formatted only a few ahead of the one being written, so the memory
+// held does not grow with the graph.
+static void FormatInChunks(size_t count, unsigned threads,
+                           const function< void (size_t begin, size_t end, DotWriter& out) >& format,
+                           const function< void (const char * text, size_t n) >& write)
+{
+    size_t chunks = (count + FORMAT_CHUNK_SIZE - 1) / FORMAT_CHUNK_SIZE;
+    size_t window = threads * FORMAT_CHUNKS_PER_THREAD;
+    vector< string > texts(window);
+    vector< bool > ready(window, false);
+    size_t next = 0;            // The next run to format
+    size_t written = 0;         // Runs before it have been written
+    bool failed = false;
+    exception_ptr error;
+    mutex m;
+    condition_variable changed;
+
+    auto worker = [&]()
+    {
+        unique_lock< mutex > lock(m);
+        while (true)
+        {
+            changed.wait(lock, [&] { return failed || next >= chunks || next < written + window; });
+            if (failed || next >= chunks)
+                return;
+            size_t chunk = next++;
+            lock.unlock();
+            string text;
+            try
+            {
+                DotWriter out(text);
+                format(chunk * FORMAT_CHUNK_SIZE, min(count, (chunk + 1) * FORMAT_CHUNK_SIZE), out);
+                out.Flush();
+            }
+            catch (...)
+            {
+                lock.lock();
+                if (!failed)
+                    error = current_exception();
+                failed = true;
+                changed.notify_all();
+                return;
+            }
+            lock.lock();
+            texts[chunk % window].swap(text);
+            ready[chunk % window] = true;
+            changed.notify_all();
+        }
+    };
+
+    vector< thread > workers;
+    try
+    {
+        for (unsigned i = 0; i < threads; i++)
+            workers.push_back(thread(worker));
+        for (size_t chunk = 0; chunk < chunks; chunk++)
+        {
+            string text;
+            {
+                unique_lock< mutex > lock(m);
+                changed.wait(lock, [&] { return failed || ready[chunk % window]; });
+                if (failed)
+                    break;
+                text.swap(texts[chunk % window]);
+                ready[chunk % window] = false;
+                written++;
+                changed.notify_all();
+            }
+            write(text.data(), text.size());
+        }
+    }
+    catch (...)
+    {
+        lock_guard< mutex > lock(m);
+        if (!failed)
+            error = current_exception();
+        failed = true;
+        changed.notify_all();
+    }
+    for (auto& t : workers)
+        t.join();
+    if (error)
+        rethrow_exception(error);
+}
+
+bool Graph::FormatsInParallel(size_t count) const
+{
+    return build_threads > 1 && count > FORMAT_CHUNK_SIZE;
+}
+
+void Graph::PrintDot(std::ostream& os)
+{
+    DotWriter out(os);
+    PrintDot(out);
+    out.Flush();
+}
+
+void Graph::PrintDot(DotWriter& out)
+{
+    WriteLabelFields();
+    out << "digraph " << title << " {\n";
+    // Print attributes
+    for (const auto& a : attributes)
+    {
+        switch (a.scope)
+        {
+            case AttributeScope::GRAPH:
+                out << "    " << a.key << " = " << "\"" << a.value << "\";\n";
+                break;
+
+            case AttributeScope::ALL_NODES:
+                out << "    node [ " << a.key << " = " << "\"" << a.value << "\" ]\n";
+                break;
+
+            case AttributeScope::ALL_EDGES:
+                out << "    edge [ " << a.key << " = " << "\"" << a.value << "\" ]\n";
+                break;
+
+            case AttributeScope::SPECIFIC_NODE:
+                throw runtime_error("Node-specific attibute in Graph!");
+        }
+    }
+    // The summary node printed when the output limit is reached
+    const AttributeSet * summary = attribute_pool.With(attribute_pool.Empty(), "shape", "none");
+    vector< string > node_styles;     // By attribute set id
+    const char * edge_label = nullptr;
+    if (fold_defaults)
+        FoldDefaults(out, summary, node_styles, edge_label);
+    out << "\n";
+    // With an output limit, printing stops once the limit is reached and a
+    // summary node stands for what was left out. Rankings and edges are only
+    // printed between nodes that were printed.
+    size_t limit = (max_output_bytes != 0) ? out.BytesWritten() + max_output_bytes : SIZE_MAX;
+    // Print nodes. Removed nodes leave gaps, so ids up to printed_nodes were
+    // either printed or removed.
+    size_t printed_nodes = 0;
+    size_t omitted_nodes = 0;
+    auto write_node = [this, &node_styles] (size_t i, DotWriter& out)
+    {
+        out << "    ";
+        if (fold_defaults)
+        {
+            nodes[i]->WriteDotLabel(out);
+            out << node_styles[AttributeSetAt(i)] << ']';
+        }
+        else
+        {
+            nodes[i]->WriteDot(out);
+        }
+        out << '\n';
+    };
+    if (limit == SIZE_MAX && FormatsInParallel(nodes.size()))
+    {
+        // Without a limit every node is printed, so runs of nodes can be
+        // formatted on their own
+        FormatInChunks(nodes.size(), build_threads,
+            [this, &write_node] (size_t begin, size_t end, DotWriter& chunk) {
+                for (size_t i = begin; i < end; i++)
+                    if (nodes[i] != nullptr)
+                        write_node(i, chunk);
+            },
+            [&out] (const char * text, size_t n) { out.Write(text, n); });
+        printed_nodes = nodes.size();
+    }
+    else
+    {
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            if (nodes[i] == nullptr)
+            {
+                if (omitted_nodes == 0)
+                    printed_nodes++;
+                continue;
+            }
+            if (omitted_nodes > 0 || out.BytesWritten() >= limit)
+            {
+                omitted_nodes++;
+                continue;
+            }
+            write_node(i, out);
+            printed_nodes++;
+        }
+    }
+    out << "\n";
+    // Print rankings, one block per group
+    vector< uint32_t > rank_members, rank_begin;
+    RankGroups(rank_members, rank_begin);
+    for (size_t g = 0; g + 1 < rank_begin.size(); g++)
+    {
+        if (out.BytesWritten() >= limit)
+            break;
+        // Members are in id order, so those that were printed come first
+        uint32_t end = rank_begin[g];
+        while (end < rank_begin[g + 1] && rank_members[end] <= printed_nodes)
+            end++;
+        if (end - rank_begin[g] < 2)
+            continue;
+        out << "    { rank=same; ";
+        for (uint32_t j = rank_begin[g]; j < end; j++)
+        {
+            BaseNode::WriteName(out, rank_members[j]);
+            out << ' ';
+        }
+        out << " }\n";
+    }
+    out << "\n";
+    // Print edges
+    size_t omitted_edges = 0;
+    if (limit == SIZE_MAX && FormatsInParallel(edges.size()))
+    {
+        FormatInChunks(edges.size(), build_threads,
+            [this, edge_label] (size_t begin, size_t end, DotWriter& chunk) {
+                for (size_t i = begin; i < end; i++)
+                {
+                    chunk << "    ";
+                    edges[i].WriteDot(chunk, nullptr, edge_label, EdgeWeight(i));
+                    chunk << '\n';
+                }
+            },
+            [&out] (const char * text, size_t n) { out.Write(text, n); });
+    }
+    else
+    {
+        for (size_t i = 0; i < edges.size(); i++)
+        {
+            const Edge& e = edges[i];
+            if (out.BytesWritten() >= limit || e.From() > printed_nodes || e.To() > printed_nodes)
+            {
+                omitted_edges++;
+                continue;
+            }
+            out << "    ";
+            e.WriteDot(out, nullptr, edge_label, EdgeWeight(i));
+            out << '\n';
+        }
+    }
+    if (omitted_nodes > 0 || omitted_edges > 0)
+    {
+        out << "    ";
+        BaseNode::WriteName(out, 0);
+        out << " [label=\"... " << (long long)omitted_nodes << " more nodes, "
+            << (long long)omitted_edges << " more edges\"";
+        if (fold_defaults)
+            out << node_styles[summary->Id()];
+        else
+            out << ", shape=\"none\"";
+        out << "]\n";
+    }
+    out << "}\n";
+}
+
+
+void Graph::FoldDefaults(DotWriter& out, const AttributeSet * summary, vector< string >& node_styles,
+                         const char *& edge_label)
+{
+    // Count the nodes using each attribute set, a table at a time, then each
+    // key and value. Sets are listed in the order of their first node.
+    vector< size_t > set_counts(attribute_pool.SetCount(), 0);
+    vector< uint32_t > first_ids(attribute_pool.SetCount(), UINT32_MAX);
+    size_t node_count = 0;
+    for (size_t t = 0; t < tables.Size(); t++)
+    {
+        const NodeTable& table = tables[t];
+        for (size_t row = 0; row < table.Size(); row++)
+        {
+            uint32_t node_id = table.ids[row];
+            if (node_id == 0)
+                continue;
+            uint32_t id = table.attribute_sets[row];
+            set_counts[id]++;
+            first_ids[id] = min(first_ids[id], node_id);
+            node_count++;
+        }
+    }
+    vector< const AttributeSet * > sets;
+    for (uint32_t id = 0; id < set_counts.size(); id++)
+        if (set_counts[id] != 0)
+            sets.push_back(attribute_pool.Set(id));
+    sort(sets.begin(), sets.end(), [&first_ids] (const AttributeSet * a, const AttributeSet * b) {
+        return first_ids[a->Id()] < first_ids[b->Id()];
+    });
+    if (max_output_bytes != 0)
+    {
+        if (set_counts[summary->Id()]++ == 0)
+            sets.push_back(summary);
+        node_count++;
+    }
+    node_styles.resize(set_counts.size());
+
+    struct KeyCount
+    {
+        size_t with_key;
+        unordered_map< uint32_t, size_t > values;
+    };
+    vector< uint32_t > keys;    // In the order they are first seen
+    unordered_map< uint32_t, KeyCount > key_counts;
+    for (auto set : sets)
+    {
+        for (size_t i = 0; i < set->Size(); i++)
+        {
+            auto f = key_counts.emplace(set->KeyId(i), KeyCount { 0, {} });
+            if (f.second)
+                keys.push_back(set->KeyId(i));
+            f.first->second.with_key += set_counts[set->Id()];
+            f.first->second.values[set->ValueId(i)] += set_counts[set->Id()];
+        }
+    }
+
+    // Nodes without a folded key are given the graph's own default back
+    unordered_map< uint32_t, uint32_t > folded;
+    vector< pair< uint32_t, const string * > > restored;
+    for (auto key : keys)
+    {
+        const KeyCount& count = key_counts[key];
+        auto best = count.values.begin();
+        for (auto v = count.values.begin(); v != count.values.end(); ++v)
+            if (v->second > best->second || (v->second == best->second && v->first < best->first))
+                best = v;
+        size_t without_key = node_count - count.with_key;
+        if (best->second < 2 || best->second <= without_key)
+            continue;
+        const char * key_string = attribute_pool.String(key);
+        auto graph_default = find_if(attributes.begin(), attributes.end(), [key_string] (const Attribute& a) {
+            return a.scope == AttributeScope::ALL_NODES && a.key == key_string;
+        });
+        if (without_key > 0 && graph_default == attributes.end())
+            continue;
+        folded[key] = best->first;
+        if (without_key > 0)
+            restored.push_back(make_pair(key, &graph_default->value));
+        out << "    node [ " << key_string << " = " << "\"" << attribute_pool.String(best->first) << "\" ]\n";
+    }
+
+    for (auto set : sets)
+    {
+        string& style = node_styles[set->Id()];
+        for (size_t i = 0; i < set->Size(); i++)
+        {
+            auto f = folded.find(set->KeyId(i));
+            if (f != folded.end() && f->second == set->ValueId(i))
+                continue;
+            style += ", ";
+            style += set->Key(i);
+            style += "=\"";
+            style += set->Value(i);
+            style += '"';
+        }
+        for (const auto& r : restored)
+        {
+            bool has_key = false;
+            for (size_t i = 0; i < set->Size() && !has_key; i++)
+                has_key = (set->KeyId(i) == r.first);
+            if (has_key)
+                continue;
+            style += ", ";
+            style += attribute_pool.String(r.first);
+            style += "=\"";
+            style += *r.second;
+            style += '"';
+        }
+    }
+
+    // Every edge has a label, so the most common one can always be folded
+    unordered_map< const char *, size_t > label_counts;
+    size_t best_count = 1;
+    for (const auto& e : edges)
+    {
+        size_t count = ++label_counts[e.Label()];
+        if (count > best_count)
+        {
+            best_count = count;
+            edge_label = e.Label();
+        }
+    }
+    if (edge_label != nullptr)
+        out << "    edge [ label = \"" << edge_label << "\" ]\n";
+}
+
+
+// Graphviz's defaults, in points
+static const double DEFAULT_FONT_SIZE = 14;
+static const double NODE_SEPARATION = 18;
+static const double RANK_SEPARATION = 36;
+static const double MIN_NODE_WIDTH = 54;
+static const double MIN_NODE_HEIGHT = 36;
+
+const char * Graph::NodeAttribute(const BaseNode * node, const char * key) const
+{
+    const AttributeSet& set = node->Attributes();
+    for (size_t i = 0; i < set.Size(); i++)
+        if (strcmp(set.Key(i), key) == 0)
+            return set.Value(i);
+    for (const auto& a : attributes)
+        if (a.scope == AttributeScope::ALL_NODES && a.key == key)
+            return a.value.c_str();
+    return nullptr;
+}
+
+enum class ShapeKind
+{
+    BOX,
+    ELLIPSE,
+    CIRCLE,
+    NONE
+};
+
+static ShapeKind ShapeOf(const char * shape)
+{
+    if (shape == nullptr)
+        return ShapeKind::ELLIPSE;
+    static const char * const boxes[] = { "box", "rect", "rectangle", "square", "record", "Mrecord" };
+    for (auto b : boxes)
+        if (strcmp(shape, b) == 0)
+            return ShapeKind::BOX;
+    if (strcmp(shape, "circle") == 0 || strcmp(shape, "doublecircle") == 0 || strcmp(shape, "point") == 0)
+        return ShapeKind::CIRCLE;
+    if (strcmp(shape, "none") == 0 || strcmp(shape, "plaintext") == 0 || strcmp(shape, "plain") == 0)
+        return ShapeKind::NONE;
+    return ShapeKind::ELLIPSE;
+}
+
+// One line of a DOT label with its escapes undone; justify is 'n'
+// (centered), 'l' or 'r', after the escape ending the line
+struct LabelLine
+{
+    string text;
+    char justify;
+};
+
+static void SplitLabel(const string& label, vector< LabelLine >& lines)
+{
+    lines.clear();
+    string text;
+    for (size_t i = 0; i < label.size(); i++)
+    {
+        if (label[i] != '\\' || i + 1 == label.size())
+        {
+            text += label[i];
+            continue;
+        }
+        char c = label[++i];
+        if (c == 'n' || c == 'l' || c == 'r')
+        {
+            lines.push_back(LabelLine { text, c });
+            text.clear();
+        }
+        else
+        {
+            text += c;
+        }
+    }
+    if (!text.empty() || lines.empty())
+        lines.push_back(LabelLine { text, 'n' });
+}
+
+// Characters are assumed to be 0.6 em wide on average
+static double TextWidth(const string& text, double font_size)
+{
+    size_t length = 0;
+    for (char c : text)
+        if (((unsigned char)c & 0xC0) != 0x80)      // Not a UTF-8 continuation byte
+            length++;
+    return length * font_size * 0.6;
+}
+
+static void MeasureLabel(const vector< LabelLine >& lines, double font_size, double& width, double& height)
+{
+    width = 0;
+    for (const auto& line : lines)
+        width = max(width, TextWidth(line.text, font_size));
+    height = lines.size() * font_size * 1.2;
+}
+
+static double FontSize(const char * font_size)
+{
+    double size = (font_size != nullptr) ? atof(font_size) : 0;
+    return (size > 0) ? size : DEFAULT_FONT_SIZE;
+}
+
+void Graph::MeasureNodes(vector< double >& widths, vector< double >& heights)
+{
+    widths.assign(nodes.size(), 0);
+    heights.assign(nodes.size(), 0);
+    ostringstream label;
+    vector< LabelLine > lines;
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        if (nodes[i] == nullptr)
+            continue;
+        label.str("");
+        WriteLabel(nodes[i], label);
+        SplitLabel(label.str(), lines);
+        MeasureLabel(lines, FontSize(NodeAttribute(nodes[i], "fontsize")), widths[i], heights[i]);
+        widths[i] += 16;
+        heights[i] += 8;
+        switch (ShapeOf(NodeAttribute(nodes[i], "shape")))
+        {
+            case ShapeKind::NONE:
+                break;
+
+            case ShapeKind::BOX:
+                widths[i] = max(widths[i], MIN_NODE_WIDTH);
+                heights[i] = max(heights[i], MIN_NODE_HEIGHT);
+                break;
+
+            case ShapeKind::ELLIPSE:
+                // The ellipse around the label's box
+                widths[i] = max(widths[i] * M_SQRT2, MIN_NODE_WIDTH);
+                heights[i] = max(heights[i] * M_SQRT2, MIN_NODE_HEIGHT);
+                break;
+
+            case ShapeKind::CIRCLE:
+                widths[i] = heights[i] = max(max(widths[i], heights[i]) * M_SQRT2, MIN_NODE_HEIGHT);
+                break;
+        }
+    }
+}
+
+void Graph::Layout(LayoutAlgorithm algorithm)
+{
+    if (expanding)
+        throw logic_error("Cannot lay out the graph while nodes are being added!");
+    WriteLabelFields();
+
+    vector< double > widths, heights;
+    MeasureNodes(widths, heights);
+    vector< double > x(nodes.size(), 0), y(nodes.size(), 0);
+    if (algorithm == LayoutAlgorithm::LAYERED)
+        LayoutLayered(widths, heights, x, y);
+    else
+        LayoutForceDirected(widths, heights, x, y);
+
+    for (size_t t = 0; t < tables.Size(); t++)
+    {
+        NodeTable& table = tables[t];
+        for (size_t row = 0; row < table.Size(); row++)
+        {
+            uint32_t id = table.ids[row];
+            if (id != 0 && !table.positions[row].IsSet())
+                table.positions[row].Set((int)lround(x[id - 1]), (int)lround(y[id - 1]));
+        }
+    }
+}
+
+void Graph::LayoutLayered(const vector< double >& widths, const vector< double >& heights,
+                          vector< double >& x, vector< double >& y)
+{
+    size_t n = nodes.size();
+    // Rank groups are placed in one row
+    vector< uint32_t > group(n);
+    vector< uint32_t > members(n), members_begin(n + 1, 0);
+    for (size_t i = 0; i < n; i++)
+    {
+        group[i] = RankRoot((uint32_t)i);
+        members_begin[group[i] + 1]++;
+    }
+    for (size_t i = 0; i < n; i++)
+        members_begin[i + 1] += members_begin[i];
+    {
+        vector< uint32_t > fill(members_begin.begin(), members_begin.end() - 1);
+        for (size_t i = 0; i < n; i++)
+            members[fill[group[i]]++] = (uint32_t)i;
+    }
+
+    // Successors and predecessors of each node, as index ranges
+    vector< uint32_t > out_begin(n + 1, 0), in_begin(n + 1, 0);
+    for (const auto& e : edges)
+    {
+        out_begin[e.From()]++;
+        in_begin[e.To()]++;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        out_begin[i + 1] += out_begin[i];
+        in_begin[i + 1] += in_begin[i];
+    }
+    vector< uint32_t > successors(edges.size()), predecessors(edges.size());
+    {
+        vector< uint32_t > out_fill(out_begin.begin(), out_begin.end() - 1);
+        vector< uint32_t > in_fill(in_begin.begin(), in_begin.end() - 1);
+        for (const auto& e : edges)
+        {
+            successors[out_fill[e.From() - 1]++] = e.To() - 1;
+            predecessors[in_fill[e.To() - 1]++] = e.From() - 1;
+        }
+    }
+
+    // Rows by breadth-first distance from the nodes nothing points to; what
+    // they do not reach, e.g. a cycle, starts again at row 0
+    vector< int > row(n, -1);
+    vector< bool > group_reached(n, false);
+    deque< uint32_t > work;
+    auto reach = [&] (uint32_t i, int r) {
+        uint32_t g = group[i];
+        if (group_reached[g])
+            return;
+        group_reached[g] = true;
+        for (uint32_t j = members_begin[g]; j < members_begin[g + 1]; j++)
+        {
+            if (row[members[j]] < 0 && nodes[members[j]] != nullptr)
+            {
+                row[members[j]] = r;
+                work.push_back(members[j]);
+            }
+        }
+    };
+    vector< uint32_t > visit_order;
+    auto drain = [&] () {
+        while (!work.empty())
+        {
+            uint32_t node = work.front();
+            work.pop_front();
+            visit_order.push_back(node);
+            for (uint32_t j = out_begin[node]; j < out_begin[node + 1]; j++)
+                reach(successors[j], row[node] + 1);
+        }
+    };
+    for (size_t i = 0; i < n; i++)
+    {
+        if (nodes[i] == nullptr)
+            continue;
+        bool source = true;
+        for (uint32_t j = in_begin[i]; j < in_begin[i + 1] && source; j++)
+            source = (predecessors[j] == i);
+        if (source)
+            reach((uint32_t)i, 0);
+    }
+    drain();
+    for (size_t i = 0; i < n; i++)
+    {
+        if (nodes[i] != nullptr && row[i] < 0)
+        {
+            reach((uint32_t)i, 0);
+            drain();
+        }
+    }
+
+    int row_count = 0;
+    for (auto i : visit_order)
+        row_count = max(row_count, row[i] + 1);
+    vector< vector< uint32_t > > rows(row_count);
+    for (auto i : visit_order)
+        rows[row[i]].push_back(i);
+
+    // Order each row by the mean position of the predecessors in the row
+    // above; a rank group moves as one
+    vector< double > index(n, 0), key(n, 0);
+    for (int r = 0; r < row_count; r++)
+    {
+        double previous = 0;
+        for (size_t k = 0; k < rows[r].size(); k++)
+        {
+            uint32_t i = rows[r][k];
+            double sum = 0;
+            size_t count = 0;
+            for (uint32_t j = in_begin[i]; j < in_begin[i + 1]; j++)
+            {
+                if (row[predecessors[j]] == r - 1)
+                {
+                    sum += index[predecessors[j]];
+                    count++;
+                }
+            }
+            key[i] = previous = (count > 0) ? sum / count : previous;
+            index[i] = (double)k;
+        }
+        for (auto i : rows[r])
+            key[group[i]] = min(key[group[i]], key[i]);
+        for (auto i : rows[r])
+            key[i] = key[group[i]];
+        stable_sort(rows[r].begin(), rows[r].end(), [&key, &group] (uint32_t a, uint32_t b) {
+            return (key[a] != key[b]) ? key[a] < key[b] : group[a] < group[b];
+        });
+        for (size_t k = 0; k < rows[r].size(); k++)
+            index[rows[r][k]] = (double)k;
+    }
+
+    // Pack the rows from the left, then, from the bottom up, move parents
+    // right to the middle of their children where there is room
+    for (int r = row_count - 1; r >= 0; r--)
+    {
+        uint32_t previous = 0;
+        for (size_t k = 0; k < rows[r].size(); k++)
+        {
+            uint32_t i = rows[r][k];
+            double left = (k == 0) ? widths[i] / 2 : x[previous] + (widths[previous] + widths[i]) / 2 + NODE_SEPARATION;
+            double sum = 0;
+            size_t count = 0;
+            for (uint32_t j = out_begin[i]; j < out_begin[i + 1]; j++)
+            {
+                if (row[successors[j]] == r + 1)
+                {
+                    sum += x[successors[j]];
+                    count++;
+                }
+            }
+            x[i] = (count > 0) ? max(left, sum / count) : left;
+            previous = i;
+        }
+    }
+
+    // Graphviz's y axis points up, so row 0 is at the top
+    double row_y = 0;
+    for (int r = row_count - 1; r >= 0; r--)
+    {
+        double height = 0;
+        for (auto i : rows[r])
+            height = max(height, heights[i]);
+        row_y += height / 2;
+        for (auto i : rows[r])
+            y[i] = row_y;
+        row_y += height / 2 + RANK_SEPARATION;
+    }
+}
+
+namespace
+{
+    // A square of the Barnes-Hut tree; children are indexes into the tree
+    struct Quad
+    {
+        double x0, y0, size;
+        double mass, cx, cy;        // Center of mass of the nodes inside
+        int32_t children[4];
+        int32_t body;               // The node, if it holds just one
+    };
+}
+
+// The child square of q that (x, y) falls in, created if needed
+static int32_t QuadChild(vector< Quad >& tree, int32_t q, double x, double y)
+{
+    double half = tree[q].size / 2;
+    int quadrant = (x >= tree[q].x0 + half ? 1 : 0) + (y >= tree[q].y0 + half ? 2 : 0);
+    if (tree[q].children[quadrant] < 0)
+    {
+        Quad child { tree[q].x0 + (quadrant & 1) * half, tree[q].y0 + (quadrant >> 1) * half, half,
+                     0, 0, 0, {-1, -1, -1, -1}, -1 };
+        tree[q].children[quadrant] = (int32_t)tree.size();
+        tree.push_back(child);
+    }
+    return tree[q].children[quadrant];
+}
+
+void Graph::LayoutForceDirected(const vector< double >& widths, const vector< double >& heights,
+                                vector< double >& x, vector< double >& y)
+{
+    const unsigned ITERATIONS = 60;
+    const double THETA = 1.0;       // Larger is faster and less accurate
+    const int MAX_DEPTH = 48;       // Nodes closer than this share a square
+
+    vector< uint32_t > bodies;
+    double mean_size = 0;
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        if (nodes[i] == nullptr)
+            continue;
+        bodies.push_back((uint32_t)i);
+        mean_size += max(widths[i], heights[i]);
+    }
+    if (bodies.empty())
+        return;
+    mean_size /= bodies.size();
+    // The ideal edge length
+    double k = mean_size + NODE_SEPARATION;
+
+    // Fixed nodes stay where they are; the others start on a spiral
+    vector< bool > fixed(nodes.size(), false);
+    for (size_t b = 0; b < bodies.size(); b++)
+    {
+        uint32_t i = bodies[b];
+        const Position& pos = PositionAt(i);
+        if (pos.IsSet())
+        {
+            fixed[i] = true;
+            x[i] = pos.X();
+            y[i] = pos.Y();
+        }
+        else
+        {
+            double radius = k * sqrt((double)b + 0.5), angle = b * 2.399963229728653;
+            x[i] = radius * cos(angle);
+            y[i] = radius * sin(angle);
+        }
+    }
+
+    vector< Quad > tree;
+    vector< int32_t > stack;
+    vector< double > dx(nodes.size()), dy(nodes.size());
+    vector< uint64_t > morton(nodes.size());
+    double temperature = k * sqrt((double)bodies.size()) / 2;
+    for (unsigned iteration = 0; iteration < ITERATIONS; iteration++)
+    {
+        // Build the tree
+        double x0 = 1e300, y0 = 1e300, x1 = -1e300, y1 = -1e300;
+        for (auto i : bodies)
+        {
+            x0 = min(x0, x[i]);
+            y0 = min(y0, y[i]);
+            x1 = max(x1, x[i]);
+            y1 = max(y1, y[i]);
+        }
+        tree.clear();
+        tree.push_back(Quad { x0, y0, max(max(x1 - x0, y1 - y0), 1.0), 0, 0, 0, {-1, -1, -1, -1}, -1 });
+        for (auto i : bodies)
+        {
+            int32_t q = 0;
+            for (int depth = 0; ; depth++)
+            {
+                if (tree[q].mass == 0)
+                {
+                    tree[q].mass = 1;
+                    tree[q].cx = x[i];
+                    tree[q].cy = y[i];
+                    tree[q].body = (int32_t)i;
+                    break;
+                }
+                if (tree[q].body >= 0 && depth < MAX_DEPTH)
+                {
+                    // Move the node already here one level down
+                    int32_t other = tree[q].body;
+                    tree[q].body = -1;
+                    int32_t c = QuadChild(tree, q, x[other], y[other]);
+                    tree[c].mass = 1;
+                    tree[c].cx = x[other];
+                    tree[c].cy = y[other];
+                    tree[c].body = other;
+                }
+                Quad& quad = tree[q];
+                quad.cx = (quad.cx * quad.mass + x[i]) / (quad.mass + 1);
+                quad.cy = (quad.cy * quad.mass + y[i]) / (quad.mass + 1);
+                quad.mass += 1;
+                if (quad.body >= 0)
+                    break;      // At the depth limit, nodes share the square
+                q = QuadChild(tree, q, x[i], y[i]);
+            }
+        }
+
+        // Repulsion between all nodes, through the tree. Nodes are visited
+        // in Z-order, so consecutive nodes walk mostly the same squares.
+        double scale = 65535 / tree[0].size;
+        for (auto i : bodies)
+        {
+            uint64_t code = 0;
+            uint32_t qx = (uint32_t)((x[i] - x0) * scale), qy = (uint32_t)((y[i] - y0) * scale);
+            for (int bit = 15; bit >= 0; bit--)
+                code = (code << 2) | (((qy >> bit) & 1) << 1) | ((qx >> bit) & 1);
+            morton[i] = code;
+        }
+        sort(bodies.begin(), bodies.end(), [&morton] (uint32_t a, uint32_t b) { return morton[a] < morton[b]; });
+        for (auto i : bodies)
+        {
+            dx[i] = dy[i] = 0;
+            stack.assign(1, 0);
+            while (!stack.empty())
+            {
+                const Quad& quad = tree[stack.back()];
+                stack.pop_back();
+                if (quad.body == (int32_t)i && quad.mass == 1)
+                    continue;
+                double ddx = x[i] - quad.cx, ddy = y[i] - quad.cy;
+                double d2 = ddx * ddx + ddy * ddy;
+                if (quad.body >= 0 || quad.size * quad.size < THETA * THETA * d2)
+                {
+                    if (d2 < 1e-9)
+                    {
+                        // Coincident nodes: push apart in a direction of their own
+                        ddx = (double)((i * 7919) % 17) - 8;
+                        ddy = (double)((i * 104729) % 17) - 8;
+                        d2 = ddx * ddx + ddy * ddy + 1;
+                    }
+                    double force = k * k * quad.mass / d2;
+                    dx[i] += ddx * force;
+                    dy[i] += ddy * force;
+                    continue;
+                }
+                for (auto c : quad.children)
+                    if (c >= 0)
+                        stack.push_back(c);
+            }
+        }
+
+        // Attraction along the edges
+        for (const auto& e : edges)
+        {
+            uint32_t a = e.From() - 1, b = e.To() - 1;
+            if (a == b)
+                continue;
+            double ddx = x[a] - x[b], ddy = y[a] - y[b];
+            double d = sqrt(ddx * ddx + ddy * ddy);
+            double force = d / k;
+            dx[a] -= ddx * force;
+            dy[a] -= ddy * force;
+            dx[b] += ddx * force;
+            dy[b] += ddy * force;
+        }
+
+        // Move by at most the temperature, which falls to zero
+        for (auto i : bodies)
+        {
+            if (fixed[i])
+                continue;
+            double d = sqrt(dx[i] * dx[i] + dy[i] * dy[i]);
+            if (d > 0)
+            {
+                double step = min(d, temperature);
+                x[i] += dx[i] / d * step;
+                y[i] += dy[i] / d * step;
+            }
+        }
+        temperature *= 1 - 1.0 / (ITERATIONS - iteration + 1);
+    }
+
+    // Shift into positive coordinates, leaving fixed nodes alone
+    bool any_fixed = find(fixed.begin(), fixed.end(), true) != fixed.end();
+    if (any_fixed)
+        return;
+    double left = 1e300, bottom = 1e300;
+    for (auto i : bodies)
+    {
+        left = min(left, x[i] - widths[i] / 2);
+        bottom = min(bottom, y[i] - heights[i] / 2);
+    }
+    for (auto i : bodies)
+    {
+        x[i] -= left;
+        y[i] -= bottom;
+    }
+}
+
+
+// Escapes the XML markup characters; control characters other than
+// whitespace cannot appear in XML 1.0 and are dropped
+static void WriteXmlEscaped(DotWriter& out, const char * s, size_t n)
+{
+    const char * run = s;
+    for (const char * end = s + n; s != end; s++)
+    {
+        const char * entity;
+        switch (*s)
+        {
+            case '&': entity = "&amp;"; break;
+            case '<': entity = "&lt;"; break;
+            case '>': entity = "&gt;"; break;
+            case '"': entity = "&quot;"; break;
+            case '\t': case '\n': case '\r': continue;
+            default:
+                if ((unsigned char)*s >= 0x20)
+                    continue;
+                entity = "";
+        }
+        out.Write(run, s - run);
+        out << entity;
+        run = s + 1;
+    }
+    out.Write(run, s - run);
+}
+
+// With one decimal, which is finer than a screen pixel
+static void WriteNumber(DotWriter& out, double x)
+{
+    long long tenths = llround(x * 10);
+    if (tenths < 0)
+    {
+        out << '-';
+        tenths = -tenths;
+    }
+    out << tenths / 10;
+    if (tenths % 10 != 0)
+        out << '.' << (char)('0' + tenths % 10);
+}
+
+// Where the line from a node's center in direction (dx, dy) leaves its shape
+static double BoundaryDistance(ShapeKind shape, double half_width, double half_height, double dx, double dy)
+{
+    double length = sqrt(dx * dx + dy * dy);
+    if (length == 0)
+        return 0;
+    dx /= length;
+    dy /= length;
+    switch (shape)
+    {
+        case ShapeKind::BOX:
+        case ShapeKind::NONE:
+            return min((dx != 0) ? half_width / fabs(dx) : 1e300, (dy != 0) ? half_height / fabs(dy) : 1e300);
+
+        case ShapeKind::CIRCLE:
+            return half_width;
+
+        default:
+            return 1 / sqrt((dx / half_width) * (dx / half_width) + (dy / half_height) * (dy / half_height));
+    }
+}
+
+void Graph::PrintSvg(ostream& os)
+{
+    DotWriter out(os);
+    PrintSvg(out);
+    out.Flush();
+}
+
+void Graph::PrintSvg(DotWriter& out)
+{
+    if (expanding)
+        throw logic_error("Cannot print the graph while nodes are being added!");
+    WriteLabelFields();
+
+    const double MARGIN = 4;
+    vector< double > widths, heights;
+    MeasureNodes(widths, heights);
+    double x0 = 1e300, y0 = 1e300, x1 = -1e300, y1 = -1e300;
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        if (nodes[i] == nullptr)
+            continue;
+        const Position& pos = PositionAt(i);
+        if (!pos.IsSet())
+            throw logic_error("Every node needs a position to be drawn; call Layout() first!");
+        x0 = min(x0, pos.X() - widths[i] / 2);
+        x1 = max(x1, pos.X() + widths[i] / 2);
+        y0 = min(y0, pos.Y() - heights[i] / 2);
+        y1 = max(y1, pos.Y() + heights[i] / 2);
+    }
+    if (x0 > x1)
+        x0 = x1 = y0 = y1 = 0;
+    // SVG's y axis points down
+    auto svg_x = [x0, MARGIN] (double x) { return x - x0 + MARGIN; };
+    auto svg_y = [y1, MARGIN] (double y) { return y1 - y + MARGIN; };
+    auto graph_attribute = [this] (AttributeScope scope, const char * key, const char * otherwise) {
+        for (const auto& a : attributes)
+            if (a.scope == scope && a.key == key)
+                return a.value.c_str();
+        return otherwise;
+    };
+    auto node_attribute = [this] (const BaseNode * node, const char * key, const char * otherwise) {
+        const char * value = NodeAttribute(node, key);
+        return (value != nullptr) ? value : otherwise;
+    };
+    auto write_attribute = [&out] (const char * name, const char * value) {
+        out << ' ' << name << "=\"";
+        WriteXmlEscaped(out, value, strlen(value));
+        out << '"';
+    };
+    auto write_text = [&out, &write_attribute] (double x, double y, const char * anchor, const char * font,
+                                               double font_size, const char * color, const string& text) {
+        out << "<text x=\"";
+        WriteNumber(out, x);
+        out << "\" y=\"";
+        WriteNumber(out, y);
+        out << "\" text-anchor=\"" << anchor << '"';
+        write_attribute("font-family", font);
+        out << " font-size=\"";
+        WriteNumber(out, font_size);
+        out << '"';
+        write_attribute("fill", color);
+        out << '>';
+        WriteXmlEscaped(out, text.data(), text.size());
+        out << "</text>\n";
+    };
+
+    double width = x1 - x0 + 2 * MARGIN, height = y1 - y0 + 2 * MARGIN;
+    out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"";
+    WriteNumber(out, width);
+    out << "pt\" height=\"";
+    WriteNumber(out, height);
+    out << "pt\" viewBox=\"0 0 ";
+    WriteNumber(out, width);
+    out << ' ';
+    WriteNumber(out, height);
+    out << "\">\n<title>";
+    WriteXmlEscaped(out, title.data(), title.size());
+    out << "</title>\n";
+    const char * background = graph_attribute(AttributeScope::GRAPH, "bgcolor", nullptr);
+    if (background != nullptr)
+    {
+        out << "<rect width=\"100%\" height=\"100%\"";
+        write_attribute("fill", background);
+        out << "/>\n";
+    }
+
+    // Edges first, so nodes are drawn over their ends
+    const char * edge_color = graph_attribute(AttributeScope::ALL_EDGES, "color", "black");
+    const char * edge_font = graph_attribute(AttributeScope::ALL_EDGES, "fontname", "Times,serif");
+    double edge_font_size = FontSize(graph_attribute(AttributeScope::ALL_EDGES, "fontsize", nullptr));
+    const char * edge_font_color = graph_attribute(AttributeScope::ALL_EDGES, "fontcolor", "black");
+    vector< LabelLine > lines;
+    for (const auto& e : edges)
+    {
+        uint32_t a = e.From() - 1, b = e.To() - 1;
+        double ax = PositionAt(a).X(), ay = PositionAt(a).Y();
+        double bx = PositionAt(b).X(), by = PositionAt(b).Y();
+        double label_x, label_y;
+        out << "<g class=\"edge\">";
+        if (a == b)
+        {
+            // A loop on the right of the node
+            double r = heights[a] / 3, right = svg_x(ax + widths[a] / 2);
+            out << "<path fill=\"none\"";
+            write_attribute("stroke", edge_color);
+            out << " d=\"M";
+            WriteNumber(out, right - 2);
+            out << ',';
+            WriteNumber(out, svg_y(ay) - r / 2);
+            out << " C";
+            WriteNumber(out, right + 2 * r);
+            out << ',';
+            WriteNumber(out, svg_y(ay) - 2 * r);
+            out << ' ';
+            WriteNumber(out, right + 2 * r);
+            out << ',';
+            WriteNumber(out, svg_y(ay) + 2 * r);
+            out << ' ';
+            WriteNumber(out, right - 2);
+            out << ',';
+            WriteNumber(out, svg_y(ay) + r / 2);
+            out << "\"/>";
+            label_x = ax + widths[a] / 2 + 2 * r;
+            label_y = ay;
+        }
+        else
+        {
+            double dx = bx - ax, dy = by - ay, length = sqrt(dx * dx + dy * dy);
+            double start = BoundaryDistance(ShapeOf(NodeAttribute(nodes[a], "shape")), widths[a] / 2, heights[a] / 2, dx, dy);
+            double end = length - BoundaryDistance(ShapeOf(NodeAttribute(nodes[b], "shape")), widths[b] / 2, heights[b] / 2,
+                                                   -dx, -dy);
+            if (end <= start)
+            {
+                // The nodes overlap: join their centers
+                start = 0;
+                end = length;
+            }
+            double ux = (length > 0) ? dx / length : 0, uy = (length > 0) ? dy / length : 0;
+            // The arrowhead is 10 long and 7 wide, as in Graphviz
+            double tip_x = ax + ux * end, tip_y = ay + uy * end;
+            double base_x = tip_x - ux * 10, base_y = tip_y - uy * 10;
+            out << "<path fill=\"none\"";
+            write_attribute("stroke", edge_color);
+            out << " d=\"M";
+            WriteNumber(out, svg_x(ax + ux * start));
+            out << ',';
+            WriteNumber(out, svg_y(ay + uy * start));
+            out << " L";
+            WriteNumber(out, svg_x(base_x));
+            out << ',';
+            WriteNumber(out, svg_y(base_y));
+            out << "\"/><polygon";
+            write_attribute("fill", edge_color);
+            write_attribute("stroke", edge_color);
+            out << " points=\"";
+            WriteNumber(out, svg_x(tip_x));
+            out << ',';
+            WriteNumber(out, svg_y(tip_y));
+            out << ' ';
+            WriteNumber(out, svg_x(base_x - uy * 3.5));
+            out << ',';
+            WriteNumber(out, svg_y(base_y + ux * 3.5));
+            out << ' ';
+            WriteNumber(out, svg_x(base_x + uy * 3.5));
+            out << ',';
+            WriteNumber(out, svg_y(base_y - ux * 3.5));
+            out << "\"/>";
+            label_x = (ax + bx) / 2;
+            label_y = (ay + by) / 2;
+        }
+        out << '\n';
+        SplitLabel(e.Label(), lines);
+        for (size_t j = 0; j < lines.size(); j++)
+        {
+            if (lines[j].text.empty())
+                continue;
+            double line_y = svg_y(label_y) + (j - (lines.size() - 1) / 2.0) * edge_font_size * 1.2 + edge_font_size * 0.3;
+            write_text(svg_x(label_x) + 4, line_y, "start", edge_font, edge_font_size, edge_font_color, lines[j].text);
+        }
+        out << "</g>\n";
+    }
+
+    ostringstream label;
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        BaseNode * node = nodes[i];
+        if (node == nullptr)
+            continue;
+        double cx = svg_x(PositionAt(i).X()), cy = svg_y(PositionAt(i).Y());
+        const char * style = node_attribute(node, "style", "");
+        const char * color = node_attribute(node, "color", "black");
+        const char * fill = "none";
+        if (strstr(style, "filled") != nullptr)
+            fill = node_attribute(node, "fillcolor", NodeAttribute(node, "color") != nullptr ? color : "lightgrey");
+        double pen_width = atof(node_attribute(node, "penwidth", "1"));
+        if (strstr(style, "bold") != nullptr)
+            pen_width = max(pen_width, 2.0);
+
+        out << "<g class=\"node\">";
+        ShapeKind shape = ShapeOf(NodeAttribute(node, "shape"));
+        if (shape != ShapeKind::NONE)
+        {
+            if (shape == ShapeKind::BOX)
+            {
+                out << "<rect x=\"";
+                WriteNumber(out, cx - widths[i] / 2);
+                out << "\" y=\"";
+                WriteNumber(out, cy - heights[i] / 2);
+                out << "\" width=\"";
+                WriteNumber(out, widths[i]);
+                out << "\" height=\"";
+                WriteNumber(out, heights[i]);
+                out << '"';
+            }
+            else
+            {
+                out << "<ellipse cx=\"";
+                WriteNumber(out, cx);
+                out << "\" cy=\"";
+                WriteNumber(out, cy);
+                out << "\" rx=\"";
+                WriteNumber(out, widths[i] / 2);
+                out << "\" ry=\"";
+                WriteNumber(out, heights[i] / 2);
+                out << '"';
+            }
+            write_attribute("fill", fill);
+            write_attribute("stroke", color);
+            if (pen_width != 1)
+            {
+                out << " stroke-width=\"";
+                WriteNumber(out, pen_width);
+                out << '"';
+            }
+            if (strstr(style, "dashed") != nullptr)
+                out << " stroke-dasharray=\"5,2\"";
+            else if (strstr(style, "dotted") != nullptr)
+                out << " stroke-dasharray=\"1,5\"";
+            out << "/>";
+        }
+        out << '\n';
+
+        label.str("");
+        WriteLabel(node, label);
+        SplitLabel(label.str(), lines);
+        double font_size = FontSize(NodeAttribute(node, "fontsize"));
+        const char * font = node_attribute(node, "fontname", "Times,serif");
+        const char * font_color = node_attribute(node, "fontcolor", "black");
+        double label_width, label_height;
+        MeasureLabel(lines, font_size, label_width, label_height);
+        for (size_t j = 0; j < lines.size(); j++)
+        {
+            double line_y = cy + (j - (lines.size() - 1) / 2.0) * font_size * 1.2 + font_size * 0.3;
+            if (lines[j].justify == 'l')
+                write_text(cx - label_width / 2, line_y, "start", font, font_size, font_color, lines[j].text);
+            else if (lines[j].justify == 'r')
+                write_text(cx + label_width / 2, line_y, "end", font, font_size, font_color, lines[j].text);
+            else
+                write_text(cx, line_y, "middle", font, font_size, font_color, lines[j].text);
+        }
+        out << "</g>\n";
+    }
+    out << "</svg>\n";
+}
+
+
+void Graph::WriteBinary(ostream& os)
+{
+    if (expanding)
+        throw logic_error("Cannot write the graph while nodes are being added!");
+    WriteLabelFields();
+
+    // Each distinct string is stored once; offset 0 is the empty string. A
+    // string is appended to the pool, then dropped again if already there.
+    vector< char > pool(1, '\0');
+    auto hash = [&pool] (uint32_t offset) {
+        const char * s = pool.data() + offset;
+        return (size_t)HashBytes(s, strlen(s));
+    };
+    auto equal = [&pool] (uint32_t a, uint32_t b) {
+        return strcmp(pool.data() + a, pool.data() + b) == 0;
+    };
+    unordered_set< uint32_t, decltype(hash), decltype(equal) > offsets(1024, hash, equal);
+    offsets.insert(0);
+    auto add_string = [&pool, &offsets] (const string& s) {
+        if (pool.size() + s.size() + 1 > UINT32_MAX)
+            throw runtime_error("Too much text for the binary graph format");
+        uint32_t offset = (uint32_t)pool.size();
+        pool.insert(pool.end(), s.begin(), s.end());
+        pool.push_back('\0');
+        auto f = offsets.insert(offset);
+        if (!f.second)
+            pool.resize(offset);
+        return *f.first;
+    };
+
+    vector< BinaryAttribute > binary_attributes;
+    for (const auto& a : attributes)
+        binary_attributes.push_back(BinaryAttribute { add_string(a.key), add_string(a.value), (uint32_t)a.scope });
+    uint32_t graph_attribute_count = (uint32_t)binary_attributes.size();
+
+    // Nodes sharing an attribute set share its range of the attribute table
+    vector< uint32_t > set_offsets(attribute_pool.SetCount(), UINT32_MAX);     // By set id
+    vector< uint32_t > string_offsets(attribute_pool.StringCount(), UINT32_MAX);
+    auto add_pool_string = [this, &string_offsets, &add_string] (uint32_t id) {
+        if (string_offsets[id] == UINT32_MAX)
+            string_offsets[id] = add_string(attribute_pool.String(id));
+        return string_offsets[id];
+    };
+
+    vector< BinaryNode > binary_nodes(nodes.size(), BinaryNode { 0, BINARY_NODE_REMOVED, 0, 0, 0, 0 });
+    ostringstream label;
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        BaseNode * node = nodes[i];
+        if (node == nullptr)
+            continue;
+        BinaryNode& b = binary_nodes[i];
+        label.str("");
+        WriteLabel(node, label);
+        b.label = add_string(label.str());
+        b.flags = 0;
+        const Position& pos = PositionAt(i);
+        if (pos.IsSet())
+        {
+            b.flags |= BINARY_NODE_HAS_POSITION;
+            b.x = pos.X();
+            b.y = pos.Y();
+        }
+        uint32_t set_id = AttributeSetAt(i);
+        const AttributeSet * set = attribute_pool.Set(set_id);
+        if (set_offsets[set_id] == UINT32_MAX)
+        {
+            set_offsets[set_id] = (uint32_t)binary_attributes.size();
+            for (size_t j = 0; j < set->Size(); j++)
+                binary_attributes.push_back(BinaryAttribute { add_pool_string(set->KeyId(j)),
+                                                              add_pool_string(set->ValueId(j)),
+                                                              (uint32_t)AttributeScope::SPECIFIC_NODE });
+        }
+        b.attributes_begin = set_offsets[set_id];
+        b.attribute_count = (uint32_t)set->Size();
+    }
+
+    // Edge labels are interned, so most lookups hit this cache
+    unordered_map< const char *, uint32_t > edge_labels;
+    vector< BinaryEdge > binary_edges;
+    binary_edges.reserve(edges.size());
+    for (size_t i = 0; i < edges.size(); i++)
+    {
+        const Edge& e = edges[i];
+        auto f = edge_labels.find(e.Label());
+        if (f == edge_labels.end())
+            f = edge_labels.emplace(e.Label(), add_string(e.Label())).first;
+        binary_edges.push_back(BinaryEdge { e.From(), e.To(), f->second, EdgeWeight(i) });
+    }
+
+    vector< BinaryRank > binary_ranks;
+    vector< uint32_t > rank_ids, rank_begin;
+    RankGroups(rank_ids, rank_begin);
+    for (size_t g = 0; g + 1 < rank_begin.size(); g++)
+        binary_ranks.push_back(BinaryRank { rank_begin[g], rank_begin[g + 1] - rank_begin[g] });
+
+    BinaryHeader header;
+    header.magic = BINARY_MAGIC;
+    header.version = BINARY_VERSION;
+    header.byte_order = BINARY_BYTE_ORDER;
+    header.title = add_string(title);
+    header.node_count = (uint32_t)binary_nodes.size();
+    header.edge_count = (uint32_t)binary_edges.size();
+    header.rank_count = (uint32_t)binary_ranks.size();
+    header.rank_id_count = (uint32_t)rank_ids.size();
+    header.attribute_count = (uint32_t)binary_attributes.size();
+    header.graph_attribute_count = graph_attribute_count;
+    header.strings_size = pool.size();
+
+    auto write = [&os] (const void * p, size_t n) {
+        os.write(static_cast< const char * >(p), n);
+    };
+    write(&header, sizeof(header));
+    write(binary_nodes.data(), binary_nodes.size() * sizeof(BinaryNode));
+    write(binary_edges.data(), binary_edges.size() * sizeof(BinaryEdge));
+    write(binary_ranks.data(), binary_ranks.size() * sizeof(BinaryRank));
+    write(rank_ids.data(), rank_ids.size() * sizeof(uint32_t));
+    write(binary_attributes.data(), binary_attributes.size() * sizeof(BinaryAttribute));
+    write(pool.data(), pool.size());
+    os.flush();
+    if (!os)
+        throw runtime_error("Could not write the binary graph");
+}
+
+void Graph::Export(Exporter& exporter)
+{
+    if (expanding)
+        throw logic_error("Cannot export the graph while nodes are being added!");
+    WriteLabelFields();
+
+    // Each distinct attribute set is converted once, indexed by set id
+    vector< vector< Attribute > > node_attributes(attribute_pool.SetCount());
+    vector< bool > converted(attribute_pool.SetCount(), false);
+    vector< string > node_keys;
+    vector< bool > seen(attribute_pool.StringCount(), false);
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        uint32_t set_id = AttributeSetAt(i);
+        if (nodes[i] == nullptr || converted[set_id])
+            continue;
+        const AttributeSet * set = attribute_pool.Set(set_id);
+        converted[set_id] = true;
+        for (size_t i = 0; i < set->Size(); i++)
+        {
+            node_attributes[set_id].push_back(Attribute { set->Key(i), set->Value(i), AttributeScope::SPECIFIC_NODE });
+            if (!seen[set->KeyId(i)])
+            {
+                seen[set->KeyId(i)] = true;
+                node_keys.push_back(set->Key(i));
+            }
+        }
+    }
+
+    exporter.Begin(title, attributes, node_keys);
+    bool parallel = exporter.FormatsInParallel();
+    if (parallel && FormatsInParallel(nodes.size()))
+    {
+        FormatInChunks(nodes.size(), build_threads,
+            [this, &exporter, &node_attributes] (size_t begin, size_t end, DotWriter& chunk) {
+                ostringstream label;
+                for (size_t i = begin; i < end; i++)
+                {
+                    if (nodes[i] == nullptr)
+                        continue;
+                    label.str("");
+                    WriteLabel(nodes[i], label);
+                    exporter.FormatNode(chunk, nodes[i]->id, label.str(), PositionAt(i),
+                                        node_attributes[AttributeSetAt(i)]);
+                }
+            },
+            [&exporter] (const char * text, size_t n) { exporter.WriteFormattedNodes(text, n); });
+    }
+    else
+    {
+        ostringstream label;
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            if (nodes[i] == nullptr)
+                continue;
+            label.str("");
+            WriteLabel(nodes[i], label);
+            exporter.WriteNode(nodes[i]->id, label.str(), PositionAt(i), node_attributes[AttributeSetAt(i)]);
+        }
+    }
+    vector< uint32_t > rank_members, rank_begin, group;
+    RankGroups(rank_members, rank_begin);
+    for (size_t g = 0; g + 1 < rank_begin.size(); g++)
+    {
+        group.assign(rank_members.begin() + rank_begin[g], rank_members.begin() + rank_begin[g + 1]);
+        exporter.WriteRank(group);
+    }
+    if (parallel && FormatsInParallel(edges.size()))
+    {
+        FormatInChunks(edges.size(), build_threads,
+            [this, &exporter] (size_t begin, size_t end, DotWriter& chunk) {
+                for (size_t i = begin; i < end; i++)
+                    exporter.FormatEdge(chunk, edges[i].From(), edges[i].To(), edges[i].Label(), EdgeWeight(i));
+            },
+            [&exporter] (const char * text, size_t n) { exporter.WriteFormattedEdges(text, n); });
+    }
+    else
+    {
+        for (size_t i = 0; i < edges.size(); i++)
+            exporter.WriteEdge(edges[i].From(), edges[i].To(), edges[i].Label(), EdgeWeight(i));
+    }
+    exporter.End();
+}
+
+
+GraphFile::GraphFile(const string& path)
+    : data{nullptr}, size{0}
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("Could not open " + path + ": " + strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BinaryHeader))
+    {
+        close(fd);
+        throw runtime_error(path + " is not a graph file");
+    }
+    size = (size_t)st.st_size;
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        throw runtime_error("Could not map " + path + ": " + strerror(errno));
+
+    // Only the layout is checked here; ids and string offsets are checked
+    // as they are used
+    const char * base = static_cast< const char * >(data);
+    header = reinterpret_cast< const BinaryHeader * >(base);
+    uint64_t offset = sizeof(BinaryHeader);
+    uint64_t nodes_at = offset;
+    offset += (uint64_t)header->node_count * sizeof(BinaryNode);
+    uint64_t edges_at = offset;
+    offset += (uint64_t)header->edge_count * sizeof(BinaryEdge);
+    uint64_t ranks_at = offset;
+    offset += (uint64_t)header->rank_count * sizeof(BinaryRank);
+    uint64_t rank_ids_at = offset;
+    offset += (uint64_t)header->rank_id_count * sizeof(uint32_t);
+    uint64_t attributes_at = offset;
+    offset += (uint64_t)header->attribute_count * sizeof(BinaryAttribute);
+    uint64_t strings_at = offset;
+
+    const char * error = nullptr;
+    if (header->magic != BINARY_MAGIC)
+        error = " is not a graph file";
+    else if (header->byte_order != BINARY_BYTE_ORDER)
+        error = " was written with another byte order";
+    else if (header->version != BINARY_VERSION)
+        error = " has an unsupported version";
+    else if (header->graph_attribute_count > header->attribute_count || header->strings_size == 0
+             || strings_at + header->strings_size != size || base[size - 1] != '\0')
+        error = " is truncated or corrupt";
+    if (error != nullptr)
+    {
+        munmap(data, size);
+        throw runtime_error(path + error);
+    }
+
+    nodes = reinterpret_cast< const BinaryNode * >(base + nodes_at);
+    edges = reinterpret_cast< const BinaryEdge * >(base + edges_at);
+    ranks = reinterpret_cast< const BinaryRank * >(base + ranks_at);
+    rank_ids = reinterpret_cast< const uint32_t * >(base + rank_ids_at);
+    attributes = reinterpret_cast< const BinaryAttribute * >(base + attributes_at);
+    strings = base + strings_at;
+}
+
+GraphFile::~GraphFile()
+{
+    munmap(data, size);
+}
+
+const char * GraphFile::String(uint32_t offset) const
+{
+    // The pool ends with a NUL, so any offset inside it is a valid string
+    if (offset >= header->strings_size)
+        throw runtime_error("Corrupt graph file: bad string offset");
+    return strings + offset;
+}
 
-BaseNode::BaseNode()
+void GraphFile::CheckId(uint32_t id) const
 {
-    ostringstream oss;
-    oss << "node" << BaseNode::counter++;
-    this->name = oss.str();
+    if (id == 0 || id > header->node_count)
+        throw runtime_error("Corrupt graph file: bad node id");
 }
 
-string BaseNode::GetName() const
+void GraphFile::PrintDot(ostream& os) const
 {
-    return this->name;
+    DotWriter out(os);
+    PrintDot(out);
+    out.Flush();
 }
 
+void GraphFile::PrintDot(DotWriter& out) const
+{
+    out << "digraph " << Title() << " {\n";
+    for (uint32_t i = 0; i < header->graph_attribute_count; i++)
+    {
+        const BinaryAttribute& a = attributes[i];
+        switch ((AttributeScope)a.scope)
+        {
+            case AttributeScope::GRAPH:
+                out << "    " << String(a.key) << " = " << "\"" << String(a.value) << "\";\n";
+                break;
+
+            case AttributeScope::ALL_NODES:
+                out << "    node [ " << String(a.key) << " = " << "\"" << String(a.value) << "\" ]\n";
+                break;
+
+            case AttributeScope::ALL_EDGES:
+                out << "    edge [ " << String(a.key) << " = " << "\"" << String(a.value) << "\" ]\n";
+                break;
+
+            default:
+                throw runtime_error("Corrupt graph file: bad graph attribute");
+        }
+    }
+    out << "\n";
+    for (uint32_t i = 0; i < header->node_count; i++)
+    {
+        const BinaryNode& n = nodes[i];
+        if (n.flags & BINARY_NODE_REMOVED)
+            continue;
+        if ((uint64_t)n.attributes_begin + n.attribute_count > header->attribute_count)
+            throw runtime_error("Corrupt graph file: bad node attributes");
+        out << "    ";
+        BaseNode::WriteName(out, i + 1);
+        out << " [label=\"" << String(n.label) << '"';
+        if (n.flags & BINARY_NODE_HAS_POSITION)
+            out << ", pos=\"" << n.x << ',' << n.y << '"';
+        for (uint32_t j = n.attributes_begin; j < n.attributes_begin + n.attribute_count; j++)
+            out << ", " << String(attributes[j].key) << "=\"" << String(attributes[j].value) << '"';
+        out << "]\n";
+    }
+    out << "\n";
+    for (uint32_t i = 0; i < header->rank_count; i++)
+    {
+        const BinaryRank& r = ranks[i];
+        if ((uint64_t)r.begin + r.count > header->rank_id_count)
+            throw runtime_error("Corrupt graph file: bad rank");
+        out << "    { rank=same; ";
+        for (uint32_t j = r.begin; j < r.begin + r.count; j++)
+        {
+            CheckId(rank_ids[j]);
+            BaseNode::WriteName(out, rank_ids[j]);
+            out << ' ';
+        }
+        out << " }\n";
+    }
+    out << "\n";
+    for (uint32_t i = 0; i < header->edge_count; i++)
+    {
+        const BinaryEdge& e = edges[i];
+        CheckId(e.from);
+        CheckId(e.to);
+        out << "    ";
+        BaseNode::WriteName(out, e.from);
+        out << " -> ";
+        BaseNode::WriteName(out, e.to);
+        out << " [label=\"" << String(e.label) << "\"";
+        if (e.weight != 1)
+            out << ", weight=" << e.weight;
+        out << "]\n";
+    }
+    out << "}\n";
+}
 
-Edge::Edge(const BaseNode * from, const BaseNode * to, string label)
+void GraphFile::Export(Exporter& exporter) const
 {
-    this->from = from;
-    this->to = to;
-    this->label = label;
+    auto attribute = [this] (uint32_t i) {
+        const BinaryAttribute& a = attributes[i];
+        return Attribute { String(a.key), String(a.value), (AttributeScope)a.scope };
+    };
+
+    vector< Attribute > graph_attributes;
+    for (uint32_t i = 0; i < header->graph_attribute_count; i++)
+        graph_attributes.push_back(attribute(i));
+    // Keys are compared by string offset, as the pool holds each string once
+    vector< string > node_keys;
+    unordered_set< uint32_t > seen;
+    for (uint32_t i = header->graph_attribute_count; i < header->attribute_count; i++)
+        if (seen.insert(attributes[i].key).second)
+            node_keys.push_back(String(attributes[i].key));
+
+    exporter.Begin(Title(), graph_attributes, node_keys);
+    vector< Attribute > node_attributes;
+    string label;
+    for (uint32_t i = 0; i < header->node_count; i++)
+    {
+        const BinaryNode& n = nodes[i];
+        if (n.flags & BINARY_NODE_REMOVED)
+            continue;
+        if ((uint64_t)n.attributes_begin + n.attribute_count > header->attribute_count)
+            throw runtime_error("Corrupt graph file: bad node attributes");
+        node_attributes.clear();
+        for (uint32_t j = n.attributes_begin; j < n.attributes_begin + n.attribute_count; j++)
+            node_attributes.push_back(attribute(j));
+        Position pos;
+        if (n.flags & BINARY_NODE_HAS_POSITION)
+            pos.Set(n.x, n.y);
+        label = String(n.label);
+        exporter.WriteNode(i + 1, label, pos, node_attributes);
+    }
+    vector< uint32_t > ids;
+    for (uint32_t i = 0; i < header->rank_count; i++)
+    {
+        const BinaryRank& r = ranks[i];
+        if ((uint64_t)r.begin + r.count > header->rank_id_count)
+            throw runtime_error("Corrupt graph file: bad rank");
+        ids.assign(rank_ids + r.begin, rank_ids + r.begin + r.count);
+        for (auto id : ids)
+            CheckId(id);
+        exporter.WriteRank(ids);
+    }
+    for (uint32_t i = 0; i < header->edge_count; i++)
+    {
+        const BinaryEdge& e = edges[i];
+        CheckId(e.from);
+        CheckId(e.to);
+        exporter.WriteEdge(e.from, e.to, String(e.label), e.weight);
+    }
+    exporter.End();
 }
 
-string Edge::ToDot()
+namespace
 {
-    ostringstream oss;
-    oss << this->from->GetName();
-    oss << " -> " << this->to->GetName();
-    oss << " [label=\"" << this->label << "\"]";
-    return oss.str();
+    // Identifies a node across two snapshots of the same structure
+    struct NodeKey
+    {
+        const void * object;
+        const void * type;
+        uint64_t ordinal;   // Tells apart null/frontier nodes of one parent
+
+        bool operator==(const NodeKey& other) const
+        {
+            return object == other.object && type == other.type && ordinal == other.ordinal;
+        }
+    };
+
+    struct NodeKeyHash
+    {
+        size_t operator()(const NodeKey& k) const
+        {
+            uint64_t h = (uint64_t)reinterpret_cast<uintptr_t>(k.object) * 0x9E3779B97F4A7C15ULL;
+            h ^= (uint64_t)reinterpret_cast<uintptr_t>(k.type) + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+            h ^= k.ordinal + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+            return (size_t)h;
+        }
+    };
+
+    // Endpoints are after ids, or before ids tagged with bit 32 for nodes
+    // that only exist in before
+    struct EdgeKey
+    {
+        uint64_t from;
+        uint64_t to;
+        string label;
+
+        bool operator==(const EdgeKey& other) const
+        {
+            return from == other.from && to == other.to && label == other.label;
+        }
+    };
+
+    struct EdgeKeyHash
+    {
+        size_t operator()(const EdgeKey& k) const
+        {
+            uint64_t h = k.from * 0x9E3779B97F4A7C15ULL;
+            h ^= k.to + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+            h ^= HashBytes(k.label.data(), k.label.size()) + (h << 6) + (h >> 2);
+            return (size_t)h;
+        }
+    };
+
+    const uint64_t BEFORE_ONLY = 1ULL << 32;
+}
+
+// keys[id - 1] is the key of node id, for nodes that have not been removed
+static vector< NodeKey > SnapshotKeys(const NodeTables& tables, const vector< BaseNode * >& nodes,
+                                      const vector< Edge >& edges)
+{
+    vector< NodeKey > keys(nodes.size(), NodeKey { nullptr, nullptr, 0 });
+    vector< bool > keyed(nodes.size(), false);
+    for (size_t t = 0; t < tables.Size(); t++)
+    {
+        const NodeTable& table = tables[t];
+        for (size_t row = 0; row < table.Size(); row++)
+        {
+            uint32_t id = table.ids[row];
+            if (id != 0 && table.objects[row] != nullptr)
+            {
+                keys[id - 1] = NodeKey { table.objects[row], table.Type(), 0 };
+                keyed[id - 1] = true;
+            }
+        }
+    }
+
+    // A null or frontier node is known by the first node with an edge to it
+    vector< uint32_t > children(nodes.size(), 0);
+    for (const auto& e : edges)
+    {
+        size_t from = e.From() - 1, to = e.To() - 1;
+        if (keyed[to] || !keyed[from] || nodes[from]->GetObject() == nullptr)
+            continue;
+        uint64_t ordinal = ((uint64_t)++children[from] << 32) | (HashBytes(e.Label(), strlen(e.Label())) & 0xFFFFFFFF);
+        keys[to] = NodeKey { keys[from].object, nodes[to]->GetTypeId(), ordinal };
+        keyed[to] = true;
+    }
+
+    // The rest, e.g. null roots, by their order in the graph
+    uint64_t unattached = 0;
+    for (size_t i = 0; i < nodes.size(); i++)
+        if (nodes[i] != nullptr && !keyed[i])
+            keys[i] = NodeKey { nullptr, nodes[i]->GetTypeId(), ++unattached };
+    return keys;
 }
 
+void Graph::MatchSnapshots(Graph& before, Graph& after, vector< uint32_t >& after_of_before,
+                           vector< uint32_t >& before_of_after, vector< bool >& changed)
+{
+    before.WriteLabelFields();
+    after.WriteLabelFields();
+    vector< NodeKey > before_keys = SnapshotKeys(before.tables, before.nodes, before.edges);
+    vector< NodeKey > after_keys = SnapshotKeys(after.tables, after.nodes, after.edges);
+
+    unordered_map< NodeKey, uint32_t, NodeKeyHash > index;
+    index.reserve(before.nodes.size());
+    for (size_t i = 0; i < before.nodes.size(); i++)
+        if (before.nodes[i] != nullptr)
+            index.emplace(before_keys[i], (uint32_t)i + 1);
+
+    after_of_before.assign(before.nodes.size(), 0);
+    before_of_after.assign(after.nodes.size(), 0);
+    changed.assign(after.nodes.size(), false);
+    ostringstream before_label, after_label;
+    for (size_t i = 0; i < after.nodes.size(); i++)
+    {
+        if (after.nodes[i] == nullptr)
+            continue;
+        auto f = index.find(after_keys[i]);
+        if (f == index.end())
+            continue;
+        before_of_after[i] = f->second;
+        after_of_before[f->second - 1] = (uint32_t)i + 1;
+
+        before_label.str("");
+        after_label.str("");
+        WriteLabel(before.nodes[f->second - 1], before_label);
+        WriteLabel(after.nodes[i], after_label);
+        changed[i] = (before_label.str() != after_label.str());
+    }
+}
 
-BaseNode * Graph::FindNodeForObject(const void * object)
+ChangeSet Graph::Diff(Graph& before, Graph& after)
 {
-    for (const auto& node : nodes)
-        if (node->RepresentsObject(object))
-            return node.get();
-    return nullptr;
+    vector< uint32_t > after_of_before, before_of_after;
+    vector< bool > changed;
+    MatchSnapshots(before, after, after_of_before, before_of_after, changed);
+    return DiffMatched(before, after, after_of_before, before_of_after, changed);
 }
 
-void Graph::AddEdge(const BaseNode * from, const BaseNode * to, string label)
+ChangeSet Graph::DiffMatched(const Graph& before, const Graph& after, const vector< uint32_t >& after_of_before,
+                             const vector< uint32_t >& before_of_after, const vector< bool >& changed)
 {
-    if (from == nullptr)
+    ChangeSet changes;
+    for (size_t i = 0; i < after.nodes.size(); i++)
     {
-        throw runtime_error("from cannot be null");
+        if (after.nodes[i] == nullptr)
+            continue;
+        if (before_of_after[i] == 0)
+            changes.added_nodes.push_back((uint32_t)i + 1);
+        else if (changed[i])
+            changes.changed_nodes.push_back((uint32_t)i + 1);
     }
-    if (to == nullptr)
+    for (size_t i = 0; i < before.nodes.size(); i++)
+        if (before.nodes[i] != nullptr && after_of_before[i] == 0)
+            changes.removed_nodes.push_back((uint32_t)i + 1);
+
+    // Edges are compared as multisets
+    auto endpoint = [&after_of_before] (uint32_t id) {
+        return (after_of_before[id - 1] != 0) ? (uint64_t)after_of_before[id - 1] : (BEFORE_ONLY | id);
+    };
+    unordered_map< EdgeKey, size_t, EdgeKeyHash > before_edges;
+    before_edges.reserve(before.edges.size());
+    for (const auto& e : before.edges)
+        before_edges[EdgeKey { endpoint(e.From()), endpoint(e.To()), e.Label() }]++;
+    for (const auto& e : after.edges)
     {
-        throw runtime_error("to cannot be null");
+        auto f = before_edges.find(EdgeKey { e.From(), e.To(), e.Label() });
+        if (f != before_edges.end() && f->second > 0)
+            f->second--;
+        else
+            changes.added_edges.push_back(EdgeChange { e.From(), e.To(), e.Label() });
+    }
+    for (const auto& e : before.edges)
+    {
+        auto f = before_edges.find(EdgeKey { endpoint(e.From()), endpoint(e.To()), e.Label() });
+        if (f->second > 0)
+        {
+            f->second--;
+            changes.removed_edges.push_back(EdgeChange { e.From(), e.To(), e.Label() });
+        }
     }
-    Edge * e = new Edge(from , to, label);
-    edges.push_back(unique_ptr<Edge>(e));
+    return changes;
 }
 
-void Graph::AddEdge(const void * fromObject, const void * toObject, string label)
+void Graph::PrintDotDiff(Graph& before, Graph& after, ostream& os)
 {
-    const BaseNode * from = FindNodeForObject(fromObject);
-    const BaseNode * to   = FindNodeForObject(toObject);
-    if (from == nullptr)
+    vector< uint32_t > after_of_before, before_of_after;
+    vector< bool > changed;
+    MatchSnapshots(before, after, after_of_before, before_of_after, changed);
+    ChangeSet changes = DiffMatched(before, after, after_of_before, before_of_after, changed);
+
+    // Removed nodes are printed after the nodes of after, numbered from there
+    uint32_t removed_base = (uint32_t)after.nodes.size();
+    auto before_name = [&after_of_before, removed_base] (uint32_t id) {
+        return (after_of_before[id - 1] != 0) ? after_of_before[id - 1] : removed_base + id;
+    };
+    const vector< Attribute > added_style { {"color", "green3", AttributeScope::SPECIFIC_NODE},
+                                            {"penwidth", "2", AttributeScope::SPECIFIC_NODE} };
+    const vector< Attribute > changed_style { {"color", "orange", AttributeScope::SPECIFIC_NODE},
+                                              {"penwidth", "2", AttributeScope::SPECIFIC_NODE} };
+    const vector< Attribute > removed_style { {"color", "red", AttributeScope::SPECIFIC_NODE},
+                                              {"style", "dashed", AttributeScope::SPECIFIC_NODE} };
+
+    DotWriter out(os);
+    out << "digraph " << after.title << " {\n";
+    for (const auto& a : after.attributes)
     {
-        throw runtime_error("Could not find the node for fromObject");
+        if (a.scope == AttributeScope::GRAPH)
+            out << "    " << a.key << " = " << "\"" << a.value << "\";\n";
+        else if (a.scope == AttributeScope::ALL_NODES)
+            out << "    node [ " << a.key << " = " << "\"" << a.value << "\" ]\n";
+        else if (a.scope == AttributeScope::ALL_EDGES)
+            out << "    edge [ " << a.key << " = " << "\"" << a.value << "\" ]\n";
     }
-    if (to == nullptr)
+    out << "\n";
+    for (size_t i = 0; i < after.nodes.size(); i++)
     {
-        throw runtime_error("Could not find the node for toObject");
+        if (after.nodes[i] == nullptr)
+            continue;
+        const vector< Attribute > * style = nullptr;
+        if (before_of_after[i] == 0)
+            style = &added_style;
+        else if (changed[i])
+            style = &changed_style;
+        out << "    ";
+        after.nodes[i]->WriteDot(out, style);
+        out << '\n';
     }
-    AddEdge(from, to, label);
+    for (auto id : changes.removed_nodes)
+    {
+        out << "    ";
+        before.nodes[id - 1]->WriteDot(out, &removed_style, removed_base + id);
+        out << '\n';
+    }
+    out << "\n";
+    vector< uint32_t > rank_members, rank_begin;
+    after.RankGroups(rank_members, rank_begin);
+    for (size_t g = 0; g + 1 < rank_begin.size(); g++)
+    {
+        out << "    { rank=same; ";
+        for (uint32_t j = rank_begin[g]; j < rank_begin[g + 1]; j++)
+        {
+            BaseNode::WriteName(out, rank_members[j]);
+            out << ' ';
+        }
+        out << " }\n";
+    }
+    out << "\n";
+
+    // Duplicates of an edge are interchangeable, so any of them may be marked
+    unordered_map< EdgeKey, size_t, EdgeKeyHash > added;
+    for (const auto& e : changes.added_edges)
+        added[EdgeKey { e.from, e.to, e.label }]++;
+    for (size_t i = 0; i < after.edges.size(); i++)
+    {
+        const Edge& e = after.edges[i];
+        const char * style = nullptr;
+        auto f = added.find(EdgeKey { e.From(), e.To(), e.Label() });
+        if (f != added.end() && f->second > 0)
+        {
+            f->second--;
+            style = "color=\"green3\", penwidth=\"2\"";
+        }
+        out << "    ";
+        e.WriteDot(out, style, nullptr, after.EdgeWeight(i));
+        out << '\n';
+    }
+    for (const auto& e : changes.removed_edges)
+    {
+        out << "    ";
+        BaseNode::WriteName(out, before_name(e.from));
+        out << " -> ";
+        BaseNode::WriteName(out, before_name(e.to));
+        out << " [label=\"" << e.label << "\", color=\"red\", style=\"dashed\"]\n";
+    }
+    out << "}\n";
+    out.Flush();
 }
 
-void Graph::SetSameRank(const BaseNode * obj1Node, const BaseNode * obj2Node)
+
+void JsonLinesExporter::WriteString(DotWriter& out, const char * s)
 {
-    vector< const BaseNode * > s;
-    if (obj1Node == nullptr)
+    static const char hex[] = "0123456789abcdef";
+    out << '"';
+    const char * run = s;
+    for (; *s != '\0'; s++)
     {
-        throw runtime_error("obj1Node cannot be null");
+        unsigned char ch = (unsigned char)*s;
+        if (ch != '"' && ch != '\\' && ch >= 0x20)
+            continue;
+        out.Write(run, s - run);
+        run = s + 1;
+        if (ch == '"' || ch == '\\')
+        {
+            out << '\\' << (char)ch;
+        }
+        else if (ch == '\n')
+        {
+            out << "\\n";
+        }
+        else
+        {
+            char escape[] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xF] };
+            out.Write(escape, sizeof(escape));
+        }
     }
-    if (obj2Node == nullptr)
+    out.Write(run, s - run);
+    out << '"';
+}
+
+void JsonLinesExporter::WriteAttributes(DotWriter& out, const vector<Attribute>& attributes, AttributeScope scope)
+{
+    out << '{';
+    bool first = true;
+    for (const auto& a : attributes)
     {
-        throw runtime_error("obj2Node cannot be null");
+        if (a.scope != scope)
+            continue;
+        if (!first)
+            out << ',';
+        first = false;
+        WriteString(out, a.key.c_str());
+        out << ':';
+        WriteString(out, a.value.c_str());
     }
-    s.push_back(obj1Node);
-    s.push_back(obj2Node);
-    rankings.push_back(s);
+    out << '}';
 }
 
-void Graph::SetSameRank(const void* obj1, const void* obj2)
+void JsonLinesExporter::Begin(const string& title, const vector<Attribute>& attributes, const vector<string>&)
 {
-    BaseNode * obj1Node = FindNodeForObject(obj1);
-    BaseNode * obj2Node = FindNodeForObject(obj2);
-    if (obj1Node == nullptr)
+    out << "{\"type\":\"graph\",\"title\":";
+    WriteString(out, title.c_str());
+    out << ",\"attributes\":";
+    WriteAttributes(out, attributes, AttributeScope::GRAPH);
+    out << ",\"node_attributes\":";
+    WriteAttributes(out, attributes, AttributeScope::ALL_NODES);
+    out << ",\"edge_attributes\":";
+    WriteAttributes(out, attributes, AttributeScope::ALL_EDGES);
+    out << "}\n";
+}
+
+void JsonLinesExporter::FormatNode(DotWriter& out, uint32_t id, const string& label, const Position& pos,
+                                   const vector<Attribute>& attributes) const
+{
+    out << "{\"type\":\"node\",\"id\":" << id << ",\"label\":";
+    WriteString(out, label.c_str());
+    if (pos.IsSet())
+        out << ",\"pos\":[" << pos.X() << ',' << pos.Y() << ']';
+    out << ",\"attributes\":";
+    WriteAttributes(out, attributes, AttributeScope::SPECIFIC_NODE);
+    out << "}\n";
+}
+
+void JsonLinesExporter::WriteRank(const vector<uint32_t>& ids)
+{
+    out << "{\"type\":\"rank\",\"nodes\":[";
+    for (size_t i = 0; i < ids.size(); i++)
     {
-        throw runtime_error("Could not find the node for obj1");
+        if (i > 0)
+            out << ',';
+        out << ids[i];
     }
-    if (obj2Node == nullptr)
+    out << "]}\n";
+}
+
+void JsonLinesExporter::FormatEdge(DotWriter& out, uint32_t from, uint32_t to, const char * label,
+                                   uint32_t weight) const
+{
+    out << "{\"type\":\"edge\",\"from\":" << from << ",\"to\":" << to << ",\"label\":";
+    WriteString(out, label);
+    if (weight != 1)
+        out << ",\"weight\":" << weight;
+    out << "}\n";
+}
+
+
+void GraphMLExporter::WriteEscaped(DotWriter& out, const char * s)
+{
+    WriteXmlEscaped(out, s, strlen(s));
+}
+
+void GraphMLExporter::Begin(const string& title, const vector<Attribute>& attributes, const vector<string>& node_keys)
+{
+    out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        << "<graphml xmlns=\"http://graphml.graphdrawing.org/xmlns\">\n"
+        << "  <key id=\"label\" for=\"node\" attr.name=\"label\" attr.type=\"string\"/>\n"
+        << "  <key id=\"x\" for=\"node\" attr.name=\"x\" attr.type=\"int\"/>\n"
+        << "  <key id=\"y\" for=\"node\" attr.name=\"y\" attr.type=\"int\"/>\n"
+        << "  <key id=\"edge_label\" for=\"edge\" attr.name=\"label\" attr.type=\"string\"/>\n"
+        << "  <key id=\"weight\" for=\"edge\" attr.name=\"weight\" attr.type=\"int\"><default>1</default></key>\n";
+
+    // Graph-wide node attributes are defaults of the node keys
+    keys = node_keys;
+    for (const auto& a : attributes)
+        if (a.scope == AttributeScope::ALL_NODES && find(keys.begin(), keys.end(), a.key) == keys.end())
+            keys.push_back(a.key);
+    for (size_t i = 0; i < keys.size(); i++)
     {
-        throw runtime_error("Could not find the node for obj2");
+        out << "  <key id=\"a" << (long long)i << "\" for=\"node\" attr.name=\"";
+        WriteEscaped(out, keys[i].c_str());
+        out << "\" attr.type=\"string\"";
+        auto f = find_if(attributes.begin(), attributes.end(), [this, i] (const Attribute& a) {
+            return a.scope == AttributeScope::ALL_NODES && a.key == keys[i];
+        });
+        if (f == attributes.end())
+        {
+            out << "/>\n";
+            continue;
+        }
+        out << "><default>";
+        WriteEscaped(out, f->value.c_str());
+        out << "</default></key>\n";
     }
-    SetSameRank(obj1Node, obj2Node);
+    size_t index = 0;
+    for (const auto& a : attributes)
+    {
+        if (a.scope != AttributeScope::GRAPH && a.scope != AttributeScope::ALL_EDGES)
+            continue;
+        bool graph = (a.scope == AttributeScope::GRAPH);
+        out << "  <key id=\"" << (graph ? "g" : "e") << (long long)index++ << "\" for=\""
+            << (graph ? "graph" : "edge") << "\" attr.name=\"";
+        WriteEscaped(out, a.key.c_str());
+        out << "\" attr.type=\"string\"><default>";
+        WriteEscaped(out, a.value.c_str());
+        out << "</default></key>\n";
+    }
+
+    out << "  <graph id=\"";
+    WriteEscaped(out, title.c_str());
+    out << "\" edgedefault=\"directed\">\n";
 }
 
-void Graph::SetAttribute(AttributeScope scope, std::string key, std::string value)
+void GraphMLExporter::FormatNode(DotWriter& out, uint32_t id, const string& label, const Position& pos,
+                                 const vector<Attribute>& attributes) const
 {
-    if (scope == AttributeScope::SPECIFIC_NODE)
-        throw logic_error("Cannot set a node-specific attribute on Graph!");
-    set_attribute(attributes, key, value, scope);
+    out << "    <node id=\"node" << id << "\"><data key=\"label\">";
+    WriteEscaped(out, label.c_str());
+    out << "</data>";
+    if (pos.IsSet())
+        out << "<data key=\"x\">" << pos.X() << "</data><data key=\"y\">" << pos.Y() << "</data>";
+    for (const auto& a : attributes)
+    {
+        size_t key = find(keys.begin(), keys.end(), a.key) - keys.begin();
+        if (key == keys.size())
+            throw logic_error("Node attribute key missing from Begin!");
+        out << "<data key=\"a" << (long long)key << "\">";
+        WriteEscaped(out, a.value.c_str());
+        out << "</data>";
+    }
+    out << "</node>\n";
 }
 
-void Graph::PrintDot(std::ostream& os)
+void GraphMLExporter::FormatEdge(DotWriter& out, uint32_t from, uint32_t to, const char * label,
+                                 uint32_t weight) const
 {
-    os << "digraph " << title << " {\n";
-    // Print attributes
+    out << "    <edge source=\"node" << from << "\" target=\"node" << to << "\"><data key=\"edge_label\">";
+    WriteEscaped(out, label);
+    out << "</data>";
+    if (weight != 1)
+        out << "<data key=\"weight\">" << weight << "</data>";
+    out << "</edge>\n";
+}
+
+void GraphMLExporter::End()
+{
+    out << "  </graph>\n</graphml>\n";
+    out.Flush();
+}
+
+
+void CsvExporter::WriteField(DotWriter& out, const char * s, size_t n)
+{
+    // Quoted only if needed, with quotes doubled
+    if (strcspn(s, ",\"\r\n") >= n)
+    {
+        out.Write(s, n);
+        return;
+    }
+    out << '"';
+    const char * run = s;
+    for (const char * end = s + n; s != end; s++)
+    {
+        if (*s != '"')
+            continue;
+        out.Write(run, s - run + 1);
+        run = s;
+    }
+    out.Write(run, s - run);
+    out << '"';
+}
+
+void CsvExporter::Begin(const string&, const vector<Attribute>&, const vector<string>&)
+{
+    nodes << "id,label,x,y,attributes\n";
+    edges << "from,to,label,weight\n";
+}
+
+void CsvExporter::FormatNode(DotWriter& out, uint32_t id, const string& label, const Position& pos,
+                             const vector<Attribute>& attributes) const
+{
+    out << id << ',';
+    WriteField(out, label.data(), label.size());
+    out << ',';
+    if (pos.IsSet())
+        out << pos.X() << ',' << pos.Y();
+    else
+        out << ',';
+    out << ',';
+    string field;
     for (const auto& a : attributes)
     {
-        switch (a.scope)
+        if (!field.empty())
+            field += ';';
+        field += a.key;
+        field += '=';
+        field += a.value;
+    }
+    WriteField(out, field.data(), field.size());
+    out << '\n';
+}
+
+void CsvExporter::FormatEdge(DotWriter& out, uint32_t from, uint32_t to, const char * label, uint32_t weight) const
+{
+    out << from << ',' << to << ',';
+    WriteField(out, label, strlen(label));
+    out << ',' << weight << '\n';
+}
+
+void CsvExporter::End()
+{
+    nodes.Flush();
+    edges.Flush();
+}
+
+
+struct SnapshotWriter::Job
+{
+    unique_ptr< Graph > graph;
+    ostream * os;
+    string path;
+    int fd;                 // Opened from path by the writing thread
+    promise< void > done;
+    exception_ptr error;    // The first failure; guarded by the worker's mutex
+};
+
+// The formatting thread prints into filling, through the ostream it is the
+// buffer of. When filling is full it is swapped with writing as soon as the
+// writing thread is done with it, so formatting and writing overlap while
+// only two buffers are ever held.
+class SnapshotWriter::Worker : public streambuf
+{
+    public:
+        explicit Worker(size_t buffer_size_);
+        ~Worker();
+        future< void > Add(unique_ptr< Job > job);
+
+    private:
+        size_t buffer_size;
+        mutex worker_mutex;
+        condition_variable changed;
+        deque< unique_ptr< Job > > jobs;
+        bool stopping;
+        vector< char > filling;
+        vector< char > writing;
+        Job * formatting_job;
+        Job * writing_job;      // Set while writing is waiting to be written
+        bool writing_last;      // writing ends writing_job's output
+        bool formatter_done;
+        thread formatter;
+        thread writer;
+
+        void Format();
+        void Write();
+        void Hand(bool last);
+        void WriteChunk(Job& job, bool last);
+
+        int overflow(int c) override;
+        streamsize xsputn(const char * s, streamsize n) override;
+};
+
+SnapshotWriter::Worker::Worker(size_t buffer_size_)
+    : buffer_size{buffer_size_}, stopping{false}, formatting_job{nullptr}, writing_job{nullptr},
+      writing_last{false}, formatter_done{false}
+{
+    if (buffer_size == 0)
+        throw logic_error("SnapshotWriter buffer size cannot be zero");
+    filling.reserve(buffer_size);
+    writing.reserve(buffer_size);
+    formatter = thread(&Worker::Format, this);
+    writer = thread(&Worker::Write, this);
+}
+
+SnapshotWriter::Worker::~Worker()
+{
+    {
+        lock_guard< mutex > lock(worker_mutex);
+        stopping = true;
+        changed.notify_all();
+    }
+    formatter.join();
+    writer.join();
+}
+
+future< void > SnapshotWriter::Worker::Add(unique_ptr< Job > job)
+{
+    future< void > done = job->done.get_future();
+    lock_guard< mutex > lock(worker_mutex);
+    jobs.push_back(std::move(job));
+    changed.notify_all();
+    return done;
+}
+
+void SnapshotWriter::Worker::Format()
+{
+    // Errors from the buffer are thrown through the stream to PrintDot
+    ostream sink(this);
+    sink.exceptions(ios::badbit);
+    while (true)
+    {
+        unique_ptr< Job > job;
         {
-            case AttributeScope::GRAPH:
-                os << "    " << a.key << " = " << "\"" << a.value << "\";\n";
+            unique_lock< mutex > lock(worker_mutex);
+            changed.wait(lock, [this] { return !jobs.empty() || stopping; });
+            if (jobs.empty())
                 break;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        formatting_job = job.get();
+        try
+        {
+            DotWriter out(sink);
+            job->graph->PrintDot(out);
+            out.Flush();
+        }
+        catch (...)
+        {
+            sink.clear();
+            lock_guard< mutex > lock(worker_mutex);
+            if (!job->error)
+                job->error = current_exception();
+        }
+        // The graph is freed here rather than on the thread that built it
+        job->graph.reset();
+        // The writing thread finishes the job and frees it
+        job.release();
+        Hand(true);
+    }
+    lock_guard< mutex > lock(worker_mutex);
+    formatter_done = true;
+    changed.notify_all();
+}
 
-            case AttributeScope::ALL_NODES:
-                os << "    node [ " << a.key << " = " << "\"" << a.value << "\" ]\n";
-                break;
+void SnapshotWriter::Worker::Hand(bool last)
+{
+    unique_lock< mutex > lock(worker_mutex);
+    changed.wait(lock, [this] { return writing_job == nullptr; });
+    filling.swap(writing);
+    filling.clear();
+    writing_job = formatting_job;
+    writing_last = last;
+    changed.notify_all();
+    // Stop formatting output that cannot be written
+    if (!last && formatting_job->error)
+        throw runtime_error("Snapshot output failed");
+}
 
-            case AttributeScope::ALL_EDGES:
-                os << "    edge [ " << a.key << " = " << "\"" << a.value << "\" ]\n";
+void SnapshotWriter::Worker::Write()
+{
+    while (true)
+    {
+        Job * job;
+        bool last;
+        {
+            unique_lock< mutex > lock(worker_mutex);
+            changed.wait(lock, [this] { return writing_job != nullptr || formatter_done; });
+            if (writing_job == nullptr)
                 break;
-
-            case AttributeScope::SPECIFIC_NODE:
-                throw runtime_error("Node-specific attibute in Graph!");
+            job = writing_job;
+            last = writing_last;
+        }
+        WriteChunk(*job, last);
+        if (last)
+        {
+            if (job->error)
+                job->done.set_exception(job->error);
+            else
+                job->done.set_value();
+            delete job;
         }
+        lock_guard< mutex > lock(worker_mutex);
+        writing_job = nullptr;
+        changed.notify_all();
     }
-    os << "\n";
-    // Print nodes
-    for (const auto& n : nodes)
+}
+
+void SnapshotWriter::Worker::WriteChunk(Job& job, bool last)
+{
+    bool failed;
     {
-        os << "    " << n->ToDot() << "\n";
+        lock_guard< mutex > lock(worker_mutex);
+        failed = (job.error != nullptr);
     }
-    os << "\n";
-    // Print rankings
-    for (const auto& r : rankings)
+    try
     {
-        os << "    { rank=same; ";
-        for (const auto& n : r)
+        if (!failed && job.os != nullptr)
+        {
+            job.os->write(writing.data(), writing.size());
+            if (last)
+                job.os->flush();
+            if (!*job.os)
+                throw runtime_error("Could not write the snapshot");
+        }
+        else if (!failed)
+        {
+            if (job.fd < 0)
+                job.fd = open(job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (job.fd < 0)
+                throw runtime_error("Could not open " + job.path + ": " + strerror(errno));
+            if (!WriteAll(job.fd, writing.data(), writing.size()))
+                throw runtime_error("Could not write " + job.path + ": " + strerror(errno));
+        }
+        if (last && job.fd >= 0)
         {
-            os << n->GetName() << " ";
+            int fd = job.fd;
+            job.fd = -1;
+            if (close(fd) != 0)
+                throw runtime_error("Could not write " + job.path + ": " + strerror(errno));
         }
-        os << " }\n";
     }
-    os << "\n";
-    // Print edges
-    for (const auto& e : edges)
+    catch (...)
+    {
+        if (last && job.fd >= 0)
+            close(job.fd);
+        lock_guard< mutex > lock(worker_mutex);
+        if (!job.error)
+            job.error = current_exception();
+    }
+}
+
+int SnapshotWriter::Worker::overflow(int c)
+{
+    if (c != traits_type::eof())
     {
-        os << "    " << e->ToDot() << "\n";
+        filling.push_back((char)c);
+        if (filling.size() >= buffer_size)
+            Hand(false);
     }
-    os << "}\n";
+    return traits_type::not_eof(c);
+}
+
+streamsize SnapshotWriter::Worker::xsputn(const char * s, streamsize n)
+{
+    filling.insert(filling.end(), s, s + n);
+    if (filling.size() >= buffer_size)
+        Hand(false);
+    return n;
+}
+
+SnapshotWriter::SnapshotWriter(size_t buffer_size)
+    : worker{new Worker(buffer_size)}
+{
 }
 
+SnapshotWriter::~SnapshotWriter()
+{
+}
+
+future< void > SnapshotWriter::PrintDot(unique_ptr< Graph > graph, ostream& os)
+{
+    if (graph == nullptr)
+        throw logic_error("No graph to print!");
+    unique_ptr< Job > job(new Job());
+    job->graph = std::move(graph);
+    job->os = &os;
+    job->fd = -1;
+    return worker->Add(std::move(job));
+}
+
+future< void > SnapshotWriter::PrintDot(unique_ptr< Graph > graph, const string& path)
+{
+    if (graph == nullptr)
+        throw logic_error("No graph to print!");
+    unique_ptr< Job > job(new Job());
+    job->graph = std::move(graph);
+    job->os = nullptr;
+    job->path = path;
+    job->fd = -1;
+    return worker->Add(std::move(job));
+}
@@ -7,10 +7,87 @@
 #include <stdexcept>
 #include <algorithm>
 #include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_set>
+#include <deque>
+#include <unordered_map>
+#include <type_traits>
+#include <mutex>
+#include <future>
 
 namespace CObjectGraph
 {
     class Graph;
+    class Exporter;
+    struct ParallelBuild;
+
+    // Buffered output sink used when printing a graph. Text is appended to
+    // one reusable buffer which is written to the target in large chunks.
+    // A string target, e.g. for output formatted on another thread, is
+    // appended to.
+    class DotWriter : private std::streambuf
+    {
+        public:
+            explicit DotWriter(std::ostream& os_, std::size_t buffer_size = 64 * 1024);
+            explicit DotWriter(int fd_, std::size_t buffer_size = 64 * 1024);
+            explicit DotWriter(std::string& str_, std::size_t buffer_size = 64 * 1024);
+            DotWriter(const DotWriter&) = delete;
+            DotWriter& operator=(const DotWriter&) = delete;
+            ~DotWriter();
+
+            DotWriter& Write(const char * s, std::size_t n);
+            DotWriter& operator<<(const char * s) { return Write(s, std::strlen(s)); }
+            DotWriter& operator<<(const std::string& s) { return Write(s.data(), s.size()); }
+            DotWriter& operator<<(char c);
+            DotWriter& operator<<(long long x);
+            DotWriter& operator<<(int x) { return *this << (long long)x; }
+            DotWriter& operator<<(unsigned x) { return *this << (long long)x; }
+
+            // A std::ostream writing into the same buffer, for label writers
+            std::ostream& Stream() { return stream; }
+            void Flush();
+            std::size_t BytesWritten() const { return bytes_flushed + (pptr() - pbase()); }
+
+        private:
+            std::vector<char> buffer;
+            std::ostream * os;
+            std::string * str;
+            int fd;
+            std::size_t bytes_flushed;
+            std::ostream stream;
+
+            void Init(std::size_t buffer_size);
+            void WriteToTarget(const char * s, std::size_t n);
+
+            int overflow(int c) override;
+            std::streamsize xsputn(const char * s, std::streamsize n) override;
+            int sync() override;
+    };
+
+#ifdef COG_WITH_ZLIB
+    // Gzip-compresses what is written to it into another stream, e.g. for
+    // Graph::PrintDot or an Exporter. The writer only copies its output into
+    // chunks; a thread of its own compresses them and writes to target,
+    // which must not be used until Close() returns. Close() finishes the
+    // gzip stream and throws if compressing or writing failed.
+    class GzipOstream : public std::ostream
+    {
+        public:
+            // level is a zlib compression level, 0 (none) to 9 (best)
+            explicit GzipOstream(std::ostream& target, int level = 6, std::size_t chunk_size = 256 * 1024);
+            GzipOstream(const GzipOstream&) = delete;
+            GzipOstream& operator=(const GzipOstream&) = delete;
+            ~GzipOstream();
+
+            void Close();
+
+        private:
+            class Buffer;
+            std::unique_ptr<Buffer> buffer;
+    };
+#endif
 
     class Position
     {
@@ -30,12 +107,10 @@ namespace CObjectGraph
                 if (!set) throw std::logic_error("You should set the position first!");
                 return y;
             }
-            std::string ToDot() const
+            void WriteDot(DotWriter& out) const
             {
                 if (!set) throw std::logic_error("You should set the position first!");
-                std::ostringstream oss;
-                oss << x << "," << y;
-                return oss.str();
+                out << x << ',' << y;
             }
 
         private:
@@ -43,20 +118,148 @@ namespace CObjectGraph
             bool set;   // Has x, y been set?
     };
 
-    class BaseNode
+    // Monotonic allocator: memory is handed out from large blocks and is
+    // only released, all at once, when the arena is destroyed.
+    class Arena
     {
         public:
-            BaseNode();
-            std::string GetName() const;
-            virtual std::string ToDot() = 0;
-            virtual void SetAttribute(std::string key, std::string value) = 0;
-            virtual void SetPosition(int x, int y) = 0;
-            virtual bool RepresentsObject(const void * object) = 0;
-            virtual ~BaseNode() { }
+            explicit Arena(std::size_t block_size_ = 64 * 1024)
+                : block_size{block_size_}, current{nullptr}, remaining{0}, bytes_allocated{0} { }
+            Arena(const Arena&) = delete;
+            Arena& operator=(const Arena&) = delete;
+
+            void * Allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t));
+            std::size_t BytesAllocated() const { return bytes_allocated; }
+
+            template <typename T, typename... Args>
+            T * New(Args&&... args)
+            {
+                return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            }
+
+        private:
+            std::size_t block_size;
+            std::vector< std::unique_ptr< char[] > > blocks;
+            char * current;
+            std::size_t remaining;
+            std::size_t bytes_allocated;
+    };
+
+    // Stores one copy of each distinct string in an Arena. Interned strings
+    // live as long as the arena.
+    class StringPool
+    {
+        public:
+            explicit StringPool(Arena& arena_) : arena(arena_) { }
+            const char * Intern(const std::string& str);
+
+        private:
+            struct Hash
+            {
+                std::size_t operator()(const char * s) const;
+            };
+            struct Equal
+            {
+                bool operator()(const char * a, const char * b) const { return std::strcmp(a, b) == 0; }
+            };
+
+            Arena& arena;
+            std::unordered_set< const char *, Hash, Equal > strings;
+    };
+
+    class AttributePool;
+
+    // The attributes of one node, in the order they were first set. Keys and
+    // values are interned in an AttributePool and stored as ids. Sets are
+    // immutable and interned too, so nodes with the same attributes share
+    // one set; setting an attribute moves a node to the set with the change.
+    class AttributeSet
+    {
+        public:
+            struct Entry
+            {
+                uint32_t key;
+                uint32_t value;
+            };
+
+            AttributeSet(AttributePool& pool_, uint32_t id_, std::vector<Entry> entries_)
+                : pool(pool_), id{id_}, entries(std::move(entries_)) { }
+
+            // Index of the set in its pool; the empty set is 0
+            uint32_t Id() const { return id; }
+
+            std::size_t Size() const { return entries.size(); }
+            uint32_t KeyId(std::size_t i) const { return entries[i].key; }
+            uint32_t ValueId(std::size_t i) const { return entries[i].value; }
+            const char * Key(std::size_t i) const;
+            const char * Value(std::size_t i) const;
+            AttributePool& Pool() const { return pool; }
+
+        private:
+            friend class AttributePool;
+            AttributePool& pool;
+            uint32_t id;
+            std::vector<Entry> entries;
+    };
+
+    // Per-graph store of attribute strings and sets. Lookups are locked, as
+    // nodes set their attributes while being created by a parallel build.
+    class AttributePool
+    {
+        public:
+            AttributePool();
+            AttributePool(const AttributePool&) = delete;
+            AttributePool& operator=(const AttributePool&) = delete;
+
+            const AttributeSet * Empty() const { return empty; }
+            // The set with key set to value, added or replaced
+            const AttributeSet * With(const AttributeSet * set, const std::string& key, const std::string& value);
+            uint32_t With(uint32_t set_id, const std::string& key, const std::string& value);
+            // Not safe while another thread adds sets
+            const AttributeSet * Set(uint32_t id) const { return &sets[id]; }
+            std::size_t SetCount() const { return sets.size(); }
+            const char * String(uint32_t id) const { return strings_by_id[id]; }
+            std::size_t StringCount() const { return strings_by_id.size(); }
+            std::size_t BytesAllocated() const;
 
         private:
-            std::string name;
-            static int counter;
+            struct SetHash
+            {
+                std::size_t operator()(const AttributeSet * set) const;
+            };
+            struct SetEqual
+            {
+                bool operator()(const AttributeSet * a, const AttributeSet * b) const;
+            };
+            // set, key and value of a past With call
+            struct Change
+            {
+                const AttributeSet * set;
+                uint32_t key;
+                uint32_t value;
+
+                bool operator==(const Change& other) const
+                {
+                    return set == other.set && key == other.key && value == other.value;
+                }
+            };
+            struct ChangeHash
+            {
+                std::size_t operator()(const Change& c) const;
+            };
+
+            std::mutex pool_mutex;
+            Arena arena;
+            StringPool strings;
+            std::vector< const char * > strings_by_id;
+            std::unordered_map< const char *, uint32_t > string_ids;    // Keyed by interned pointer
+            std::deque< AttributeSet > sets;
+            std::unordered_set< const AttributeSet *, SetHash, SetEqual > set_index;
+            std::unordered_map< Change, const AttributeSet *, ChangeHash > changes;
+            const AttributeSet * empty;
+
+            uint32_t Id(const std::string& s);
+            const AttributeSet * Intern(std::vector<AttributeSet::Entry> entries);
     };
 
     enum class AttributeScope
@@ -67,6 +270,35 @@ namespace CObjectGraph
         SPECIFIC_NODE
     };
 
+    enum class TraversalOrder
+    {
+        DEPTH_FIRST,
+        BREADTH_FIRST
+    };
+
+    // What Graph::AddEdge does with an edge that has the same endpoints and
+    // label as one added before
+    enum class DuplicateEdges
+    {
+        KEEP,
+        DROP,
+        COUNT               // Dropped, and counted in the first one's weight
+    };
+
+    // What Graph::SetCaptureLabels keeps of each node's label as it is added
+    enum class LabelCapture
+    {
+        NONE,               // Written from the objects when the graph is printed
+        TEXT,               // Written as the nodes are added
+        FIELDS              // Label fields copied, and written when printed
+    };
+
+    enum class LayoutAlgorithm
+    {
+        LAYERED,            // Rows by distance from the roots, for trees and lists
+        FORCE_DIRECTED      // Barnes-Hut spring embedding, for general graphs
+    };
+
     struct Attribute
     {
         std::string key;
@@ -91,11 +323,452 @@ namespace CObjectGraph
         }
     }
 
+    // Identifies a C++ type without RTTI: the address of TypeTag<T>::id
+    // differs for every T and is known at compile time.
+    template <typename T>
+    struct TypeTag
+    {
+        static const char id;
+    };
+
+    template <typename T>
+    const char TypeTag<T>::id = 0;
+
+    // The type nodes are looked up by; nullptr, matching any type, for void
+    template <typename T>
+    const void * TypeIdOf() { return &TypeTag<T>::id; }
+
+    template <>
+    inline const void * TypeIdOf<void>() { return nullptr; }
+
+    class BaseNode;
+
+    // Tells pointers to nodes from pointers to the objects they represent.
+    // Unlike std::is_base_of, this also works for incomplete types.
+    template <typename T>
+    struct IsNodePointer
+    {
+        static char Check(const BaseNode *);
+        static long Check(const void *);
+        static const bool value = (sizeof(Check((const T*)nullptr)) == sizeof(char));
+    };
+
+    // The nodes of one type, stored by column: row r holds the object, the
+    // position and the attribute set id of node ids[r]. Whole-graph passes
+    // stream through these arrays instead of visiting the node objects. A
+    // node keeps its row once its graph has it; a removed node's id is 0.
+    // The table also indexes its nodes by object address, in shards that a
+    // parallel build locks independently.
+    class NodeTable
+    {
+        public:
+            static const std::size_t INDEX_SHARDS = 64;
+
+            // Captures the labels of the table's nodes from row begin on
+            typedef void (*LabelCapturer)(Graph& graph, const NodeTable& table, std::size_t begin);
+
+            NodeTable(const void * type_, uint32_t index_, AttributePool& attribute_pool_)
+                : capture_labels{nullptr}, type{type_}, index{index_}, attribute_pool(attribute_pool_) { }
+            NodeTable(const NodeTable&) = delete;
+            NodeTable& operator=(const NodeTable&) = delete;
+
+            // TypeTag<T>::id of the nodes' type
+            const void * Type() const { return type; }
+            // Position in the NodeTables holding it
+            uint32_t Index() const { return index; }
+            std::size_t Size() const { return ids.size(); }
+            AttributePool& Pool() const { return attribute_pool; }
+            // A row with no position and the empty attribute set
+            uint32_t AddRow(uint32_t id, const void * object);
+            // A copy of a row of another table of the same type
+            uint32_t AddRow(uint32_t id, const NodeTable& from, uint32_t row);
+            // Not safe while another thread adds attribute sets
+            const AttributeSet * Attributes(uint32_t row) const { return attribute_pool.Set(attribute_sets[row]); }
+            static std::size_t Shard(const void * object);
+            std::size_t BytesAllocated() const;
+
+            std::vector< const void * > objects;
+            std::vector< Position > positions;
+            std::vector< uint32_t > attribute_sets;     // AttributePool set ids
+            std::vector< uint32_t > ids;
+            // The first node of the type for each object address
+            std::unordered_map< const void *, BaseNode * > by_object[INDEX_SHARDS];
+            // Set when the first node is created, as only then is the type known
+            LabelCapturer capture_labels;
+
+        private:
+            const void * type;
+            uint32_t index;
+            AttributePool& attribute_pool;
+    };
+
+    // The node tables of a graph, or of a parallel build worker, one per
+    // node type in the order the types were first seen
+    class NodeTables
+    {
+        public:
+            explicit NodeTables(AttributePool& attribute_pool_) : attribute_pool(attribute_pool_), last{nullptr} { }
+            NodeTables(const NodeTables&) = delete;
+            NodeTables& operator=(const NodeTables&) = delete;
+
+            // The table of the type, added if there is none
+            NodeTable& For(const void * type);
+            // nullptr if there is no table for the type
+            NodeTable * Find(const void * type) const;
+            std::size_t Size() const { return tables.size(); }
+            NodeTable& operator[](std::size_t i) const { return *tables[i]; }
+            std::size_t BytesAllocated() const;
+
+        private:
+            AttributePool& attribute_pool;
+            std::vector< std::unique_ptr< NodeTable > > tables;
+            std::unordered_map< const void *, NodeTable * > by_type;
+            // The table found last; nodes tend to be added by type in runs
+            mutable NodeTable * last;
+    };
+
+    class BaseNode
+    {
+        public:
+            BaseNode(uint32_t id_, const void * type_, NodeTable& table_, const void * object)
+                : table{&table_}, row{table_.AddRow(id_, object)},
+                  id{id_}, depth{0}, label_is_fields{false}, type{type_}, label{nullptr} { }
+            uint32_t GetId() const { return id; }
+            // TypeTag<T>::id of the Node<T>
+            const void * GetTypeId() const { return type; }
+            std::string GetName() const;
+            void WriteName(DotWriter& out) const { WriteName(out, id); }
+            static void WriteName(DotWriter& out, uint32_t id) { out << "node" << id; }
+            // Extra attributes are appended to the node's own; print_id, if
+            // not 0, is printed in place of the node's id
+            void WriteDot(DotWriter& out, const std::vector<Attribute> * extra = nullptr, uint32_t print_id = 0);
+            // Writes the name, label and position, leaving the list open
+            // for the attributes
+            void WriteDotLabel(DotWriter& out, uint32_t print_id = 0);
+            void SetAttribute(std::string key, std::string value);
+            const AttributeSet& Attributes() const { return *table->Attributes(row); }
+            const Position& GetPosition() const { return table->positions[row]; }
+            void SetPosition(int x, int y) { table->positions[row].Set(x, y); }
+            template <typename T>
+            bool RepresentsObject(const T* object) const
+            {
+                return type == &TypeTag<T>::id && GetObject() == object;
+            }
+            bool RepresentsObject(const void * object) const { return GetObject() == object; }
+            virtual void ExpandRelatedObjects(Graph * graph) = 0;
+            virtual const void * GetObject() const = 0;
+            virtual void WriteLabel(std::ostream& oss) = 0;
+            // Copies what the label is written from into the arena, for
+            // WriteLabelFields to write later; nullptr if it cannot be copied
+            virtual const char * CopyLabelFields(Arena& arena, StringPool& strings) { return nullptr; }
+            virtual void WriteLabelFields(std::ostream& oss, const char * fields) { }
+            // Changes whenever the object's label or related objects change;
+            // 0 if unknown. Used by incremental snapshots.
+            virtual uint64_t ObjectVersion() { return 0; }
+            virtual ~BaseNode() { }
+
+        private:
+            friend class Graph;     // Renumbers nodes after a parallel build
+            // The row holding the node's object, position and attributes; a
+            // parallel build worker's own table until the build is merged
+            NodeTable * table;
+            uint32_t row;
+            uint32_t id;    // Rendered as "node<id>" when the graph is printed
+            uint32_t depth; // Distance from the root it was reached from
+            bool label_is_fields;   // label holds copied fields rather than text
+            const void * type;
+            const char * label; // Captured by the graph; written instead of WriteLabel
+    };
+
+    // Field descriptors, listed once per type with COG_DESCRIBE_NODE. A
+    // label field is written as "name: value" on a line of the node's label;
+    // an edge field is a pointer to an object that gets its own node and an
+    // edge labeled with the field's name.
+    template <typename T, typename F>
+    struct LabelField
+    {
+        const char * name;
+        F T::* member;
+    };
+
+    template <typename T, typename U>
+    struct EdgeField
+    {
+        const char * name;
+        U * T::* member;
+        bool same_rank;     // The object's node is put in the same rank
+    };
+
+    template <typename T, typename F>
+    LabelField<T, F> MakeLabelField(const char * name, F T::* member)
+    {
+        return LabelField<T, F> { name, member };
+    }
+
+    template <typename T, typename U>
+    EdgeField<T, U> MakeEdgeField(const char * name, U * T::* member, bool same_rank)
+    {
+        return EdgeField<T, U> { name, member, same_rank };
+    }
+
+    // Calls visitor(field) for each field, in order
+    template <typename Visitor, typename... Fields>
+    void VisitFields(Visitor& visitor, const Fields&... fields)
+    {
+        int in_order[] = { 0, (visitor(fields), 0)... };
+        (void)in_order;
+    }
+
+    // The fields of T; specialized by COG_DESCRIBE_NODE
+    template <typename T>
+    struct NodeFields
+    {
+        static const bool described = false;
+
+        template <typename Visitor>
+        static void Visit(Visitor&) { }
+    };
+
+    // Writes n chars of text with the quotes and backslashes escaped, as
+    // the label they go into is a quoted DOT string
+    inline void WriteEscapedFieldText(std::ostream& oss, const char * text, std::size_t n)
+    {
+        const char * end = text + n;
+        for (const char * c = text; c != end; c++)
+        {
+            if (*c != '"' && *c != '\\')
+                continue;
+            oss.write(text, c - text);
+            oss << '\\' << *c;
+            text = c + 1;
+        }
+        oss.write(text, end - text);
+    }
+
+    // Numbers are written as they are; anything else, chars included, may
+    // write quotes or backslashes and is escaped
+    template <typename F>
+    struct IsPlainNumber
+    {
+        static const bool value = std::is_arithmetic<F>::value && !std::is_same<F, char>::value
+            && !std::is_same<F, signed char>::value && !std::is_same<F, unsigned char>::value;
+    };
+
+    // Strings are quoted, so empty and blank values show
+    template <typename F>
+    typename std::enable_if< IsPlainNumber<F>::value >::type
+    WriteFieldValue(std::ostream& oss, const F& value) { oss << value; }
+
+    template <typename F>
+    typename std::enable_if< !IsPlainNumber<F>::value >::type
+    WriteFieldValue(std::ostream& oss, const F& value)
+    {
+        std::ostringstream text;
+        text << value;
+        const std::string& s = text.str();
+        WriteEscapedFieldText(oss, s.data(), s.size());
+    }
+
+    inline void WriteFieldValue(std::ostream& oss, const std::string& value)
+    {
+        oss << '\'';
+        WriteEscapedFieldText(oss, value.data(), value.size());
+        oss << '\'';
+    }
+
+    inline void WriteFieldValue(std::ostream& oss, const char * value)
+    {
+        if (value == nullptr)
+        {
+            oss << "null";
+        }
+        else
+        {
+            oss << '\'';
+            WriteEscapedFieldText(oss, value, std::strlen(value));
+            oss << '\'';
+        }
+    }
+    inline void WriteFieldValue(std::ostream& oss, char * value) { WriteFieldValue(oss, (const char *)value); }
+
+    // Picks the WriteFieldValue for a field of type F. Char arrays need not
+    // be terminated, so they are bounded by their size rather than passed
+    // on, which would take the char pointer overload.
+    template <typename F>
+    struct FieldValue
+    {
+        static void Write(std::ostream& oss, const F& value) { WriteFieldValue(oss, value); }
+    };
+
+    template <std::size_t N>
+    struct FieldValue< char[N] >
+    {
+        static void Write(std::ostream& oss, const char (&value)[N])
+        {
+            oss << '\'';
+            WriteEscapedFieldText(oss, value, strnlen(value, N));
+            oss << '\'';
+        }
+    };
+
+    template <std::size_t N>
+    struct FieldValue< const char[N] > : FieldValue< char[N] > { };
+
+    template <typename T>
+    struct FieldLabelWriter
+    {
+        std::ostream& oss;
+        const T * object;
+
+        FieldLabelWriter(std::ostream& oss_, const T * object_) : oss(oss_), object{object_} { }
+
+        template <typename F>
+        void operator()(const LabelField<T, F>& field)
+        {
+            oss << field.name << ": ";
+            FieldValue<F>::Write(oss, object->*field.member);
+            oss << "\\l";
+        }
+
+        template <typename U>
+        void operator()(const EdgeField<T, U>&) { }
+    };
+
+    // How a label field is copied by LabelCapture::FIELDS. Trivially
+    // copyable values are copied as they are and strings are interned;
+    // other values are written, already escaped, when copied.
+    template <typename F, typename Enable = void>
+    struct FieldCopy
+    {
+        typedef const char * Stored;
+
+        static void Copy(void * to, const F& value, StringPool& strings)
+        {
+            std::ostringstream oss;
+            FieldValue<F>::Write(oss, value);
+            const char * text = strings.Intern(oss.str());
+            std::memcpy(to, &text, sizeof(text));
+        }
+
+        static void Write(std::ostream& oss, const void * from) { oss << *(const Stored *)from; }
+    };
+
+    template <typename F>
+    struct FieldCopy< F, typename std::enable_if< std::is_trivially_copyable<F>::value >::type >
+    {
+        typedef F Stored;
+
+        static void Copy(void * to, const F& value, StringPool&) { std::memcpy(to, &value, sizeof(F)); }
+        static void Write(std::ostream& oss, const void * from) { FieldValue<F>::Write(oss, *(const F *)from); }
+    };
+
+    template <>
+    struct FieldCopy< const char * >
+    {
+        typedef const char * Stored;
+
+        static void Copy(void * to, const char * value, StringPool& strings)
+        {
+            const char * copy = (value != nullptr) ? strings.Intern(value) : nullptr;
+            std::memcpy(to, &copy, sizeof(copy));
+        }
+
+        static void Write(std::ostream& oss, const void * from) { WriteFieldValue(oss, *(const Stored *)from); }
+    };
+
+    template <>
+    struct FieldCopy< char * > : FieldCopy< const char * > { };
+
+    template <>
+    struct FieldCopy< std::string >
+    {
+        typedef const char * Stored;
+
+        static void Copy(void * to, const std::string& value, StringPool& strings)
+        {
+            const char * copy = strings.Intern(value);
+            std::memcpy(to, &copy, sizeof(copy));
+        }
+
+        static void Write(std::ostream& oss, const void * from) { WriteFieldValue(oss, *(const Stored *)from); }
+    };
+
+    // Lays out the copied label fields of a T one after another, each
+    // aligned for its type. Without fields to copy into, only measures them.
+    template <typename T>
+    struct FieldCopier
+    {
+        const T * object;
+        StringPool& strings;
+        char * fields;
+        std::size_t size;
+
+        FieldCopier(const T * object_, StringPool& strings_, char * fields_)
+            : object{object_}, strings(strings_), fields{fields_}, size{0} { }
+
+        template <typename F>
+        void operator()(const LabelField<T, F>& field)
+        {
+            typedef typename FieldCopy<F>::Stored Stored;
+            size = (size + alignof(Stored) - 1) / alignof(Stored) * alignof(Stored);
+            if (fields != nullptr)
+                FieldCopy<F>::Copy(fields + size, object->*field.member, strings);
+            size += sizeof(Stored);
+        }
+
+        template <typename U>
+        void operator()(const EdgeField<T, U>&) { }
+    };
+
+    // Writes the label fields copied by FieldCopier
+    template <typename T>
+    struct CopiedFieldWriter
+    {
+        std::ostream& oss;
+        const char * fields;
+        std::size_t offset;
+
+        CopiedFieldWriter(std::ostream& oss_, const char * fields_) : oss(oss_), fields{fields_}, offset{0} { }
+
+        template <typename F>
+        void operator()(const LabelField<T, F>& field)
+        {
+            typedef typename FieldCopy<F>::Stored Stored;
+            offset = (offset + alignof(Stored) - 1) / alignof(Stored) * alignof(Stored);
+            oss << field.name << ": ";
+            FieldCopy<F>::Write(oss, fields + offset);
+            oss << "\\l";
+            offset += sizeof(Stored);
+        }
+
+        template <typename U>
+        void operator()(const EdgeField<T, U>&) { }
+    };
+
+    template <typename T>
+    struct FieldExpander
+    {
+        Graph * graph;
+        BaseNode * node;
+        const T * object;
+
+        FieldExpander(Graph * graph_, BaseNode * node_, const T * object_)
+            : graph{graph_}, node{node_}, object{object_} { }
+
+        template <typename F>
+        void operator()(const LabelField<T, F>&) { }
+
+        // Defined after Graph
+        template <typename U>
+        void operator()(const EdgeField<T, U>& field);
+    };
+
     template <typename T>
     class Node: public BaseNode
     {
         public:
-            explicit Node(const T* object, std::string var_name = "")
+            Node(uint32_t id, NodeTable& table, const T* object, std::string var_name = "")
+                : BaseNode(id, &TypeTag<T>::id, table, object)
             {
                 this->object = object;
                 this->var_name = var_name;
@@ -103,48 +776,55 @@ namespace CObjectGraph
                 SetNodeAttributes();
             }
 
-            void SetPosition(int x, int y) override
+            void ExpandRelatedObjects(Graph * graph) override
             {
-                pos.Set(x, y);
+                if (object != nullptr)
+                    AddRelatedObjects(graph);
             }
 
-            std::string ToDot() override
+            const void * GetObject() const override
             {
-                std::ostringstream oss;
-                oss << this->GetName() << " [label=\"";
-                (object == nullptr) ? WriteNullNodeLabel(oss) : WriteNodeLabel(oss);
-                oss << "\"";
+                return object;
+            }
 
-                if (pos.IsSet()) oss << ", pos=\"" << pos.ToDot() << "\"";
+            void WriteLabel(std::ostream& oss) override
+            {
+                (object == nullptr) ? WriteNullNodeLabel(oss) : WriteNodeLabel(oss);
+            }
 
-                for (const auto& a : attributes)
-                    oss << ", " << a.key << "=\"" << a.value << "\"";
-                oss << "]";
-                return oss.str();
+            uint64_t ObjectVersion() override
+            {
+                // Default implementation does not know
+                return 0;
             }
 
-            void SetAttribute(std::string key, std::string value) override
+            const char * CopyLabelFields(Arena& arena, StringPool& strings) override
             {
-                if (key == "label" || key == "pos")
-                    throw std::logic_error("label and pos attributes cannot be set this way!");
-                set_attribute(attributes, key, value, AttributeScope::SPECIFIC_NODE);
+                // Only labels written from the label fields can be copied
+                if (!NodeFields<T>::described || object == nullptr)
+                    return nullptr;
+                static const std::size_t size = CopiedFieldsSize(strings);
+                FieldCopier<T> copier(object, strings, (char *)arena.Allocate(size));
+                NodeFields<T>::Visit(copier);
+                return copier.fields;
             }
 
-            bool RepresentsObject(const void * object) override
+            void WriteLabelFields(std::ostream& oss, const char * fields) override
             {
-                return ((const void *)this->object == object);
+                CopiedFieldWriter<T> writer(oss, fields);
+                NodeFields<T>::Visit(writer);
             }
 
             void AddRelatedObjects(Graph * graph)
             {
-                // Default implementation does nothing
+                // Default implementation follows the edge fields, if any
+                FieldExpander<T> expander(graph, this, object);
+                NodeFields<T>::Visit(expander);
             }
 
         private:
             const T* object;
-            Position pos;
             std::string var_name;
-            std::vector<Attribute> attributes;
             static const char* type_name;
 
             void SetNodeAttributes()
@@ -152,34 +832,193 @@ namespace CObjectGraph
                 // Default implementation does nothing
             }
 
-            void WriteNodeLabel(std::ostringstream& oss)
+            void WriteNodeLabel(std::ostream& oss)
             {
-                oss << type_name;
+                // Default implementation writes the label fields, or else
+                // the type's name
+                if (!NodeFields<T>::described)
+                {
+                    oss << type_name;
+                    return;
+                }
+                FieldLabelWriter<T> writer(oss, object);
+                NodeFields<T>::Visit(writer);
             }
 
-            void WriteNullNodeLabel(std::ostringstream& oss)
+            void WriteNullNodeLabel(std::ostream& oss)
             {
                 oss << "null";
             }
+
+            static std::size_t CopiedFieldsSize(StringPool& strings)
+            {
+                FieldCopier<T> sizer(nullptr, strings, nullptr);
+                NodeFields<T>::Visit(sizer);
+                return std::max< std::size_t >(sizer.size, 1);
+            }
+    };
+
+    // Stands for the objects left out of the graph where a traversal limit
+    // was reached, e.g. "... 3 more"
+    class FrontierNode: public BaseNode
+    {
+        public:
+            FrontierNode(uint32_t id, NodeTable& table, std::string what_ = "");
+
+            void ExpandRelatedObjects(Graph * graph) override { }
+            const void * GetObject() const override { return nullptr; }
+            void WriteLabel(std::ostream& oss) override;
+
+            void Add(std::size_t n = 1) { count += n; }
+            std::size_t Count() const { return count; }
+
+        private:
+            friend class Graph;     // Links the node it belongs to once
+            std::size_t count;
+            std::string what;       // Appended to the count, e.g. "edges"
+            bool linked;            // The edge leading to it has been added
     };
 
     class Edge
     {
         public:
-            Edge(const BaseNode * from, const BaseNode * to, std::string label);
-            std::string ToDot();
+            Edge(const BaseNode * from, const BaseNode * to, const char * label);
+            uint32_t From() const { return from; }
+            uint32_t To() const { return to; }
+            const char * Label() const { return label; }
+            // A label equal to default_label, e.g. one printed as an edge
+            // default, is left out, as is a weight of 1
+            void WriteDot(DotWriter& out, const char * style = nullptr, const char * default_label = nullptr,
+                          uint32_t weight = 1) const;
 
         private:
-            const BaseNode * from;
-            const BaseNode * to;
-            std::string label;
+            uint32_t from;
+            uint32_t to;
+            const char * label;     // Interned in the graph's StringPool
+    };
+
+    struct EdgeChange
+    {
+        uint32_t from;
+        uint32_t to;
+        std::string label;
+    };
+
+    // What Graph::Refresh found changed since the previous snapshot. Nodes
+    // are given by id.
+    struct ChangeSet
+    {
+        std::vector< uint32_t > added_nodes;
+        std::vector< uint32_t > removed_nodes;
+        std::vector< uint32_t > changed_nodes;      // Label or version changed
+        std::vector< EdgeChange > added_edges;
+        std::vector< EdgeChange > removed_edges;
+
+        bool Empty() const
+        {
+            return added_nodes.empty() && removed_nodes.empty() && changed_nodes.empty()
+                && added_edges.empty() && removed_edges.empty();
+        }
     };
 
+    // Each Graph numbers its own nodes (node1, node2, ...) in the order they
+    // are added, so the output does not depend on other graphs built by the
+    // process. A Graph is not safe to use from several threads at once, but
+    // independent Graph instances share no mutable state and can be built and
+    // printed on different threads in parallel.
+    //
+    // AddNode called from AddRelatedObjects creates the object's node at once
+    // but only queues it to be expanded, so the objects the new node leads to
+    // have no nodes yet. AddEdge and SetSameRank by object with an endpoint
+    // that has no node of its type are held until the traversal is over and
+    // applied then, to a node of another type at the address if there is
+    // still none of its own, and throw if the address has no node at all.
+    // Edges held this way are printed after the others.
+    //
+    // SetBuildThreads(n) with n > 1 runs the AddRelatedObjects callbacks on n
+    // threads. The nodes are then renumbered so the output is identical to a
+    // serial build. In that mode the callbacks must only read the objects.
+    //
+    // The build threads also format large graphs in PrintDot and Export, in
+    // runs of consecutive nodes and edges written out in order, so the output
+    // is the same as a serial one. Node labels that were not captured are
+    // then written from several threads at once. PrintDot with an output
+    // limit stays serial.
+    //
+    // The SetMax* limits bound the traversal of huge structures; 0 means no
+    // limit. Objects beyond the depth or node limit get no node of their own:
+    // AddNode returns a FrontierNode shared by the node being expanded, which
+    // counts them. Once a limit has left objects out, a held AddEdge or
+    // SetSameRank endpoint that still has no node is taken to be one of them
+    // and counted in the frontier of the node that asked for it instead of
+    // throwing. Edges beyond the edge limit are counted in a FrontierNode
+    // of their own. The output byte limit is approximate and applied by
+    // PrintDot, which summarizes what it leaves out. Builds with limits run
+    // serially, as which objects make the cut depends on the serial order.
+    //
+    // SetIncremental(true) records what each node's AddRelatedObjects call
+    // did, so that Refresh() can re-walk the structure from the roots and
+    // report what changed. Nodes keep their ids; nodes no longer reachable are
+    // removed and leave a gap in the numbering. A node whose ObjectVersion
+    // (see COG_OBJECT_VERSION) is unchanged is not expanded again: its
+    // recorded related objects and edges are reused. Without a version, nodes
+    // are always expanded again and compared by label. Edges keep their place
+    // in the output across a Refresh, and the edges it adds are printed after
+    // them. Incremental graphs are built serially.
+    //
+    // Labels are normally written from the objects when the graph is printed.
+    // SetCaptureLabels(true) renders them as nodes are added instead, so a
+    // snapshot can be printed or diffed after the objects change or are freed.
+    // LabelCapture::FIELDS keeps the same snapshot for less work while the
+    // objects must stay put: it only copies the label fields of types
+    // declared with COG_DESCRIBE_NODE, once AddNode has reached all the
+    // objects, and leaves writing them out to the first pass that needs the
+    // labels, which does it on the build threads. Other labels are rendered
+    // as with true. A type that also has COG_WRITE_NODE_LABEL should not use
+    // it, as the copy is written from the fields.
+    //
+    // SetFoldDefaults(true) makes PrintDot find the attribute values most
+    // nodes share, and the most common edge label, and print them once as
+    // node and edge defaults; only the differences are printed per element.
+    // A value is only folded if the nodes without it can be printed with the
+    // graph's own ALL_NODES value for the key, so the drawing is unchanged.
+    //
+    // SetDuplicateEdges(DROP) keeps only the first of the edges with the same
+    // endpoints and label, so structures with shared substructures print
+    // each relationship once. COUNT also counts the duplicates and prints
+    // the count as the edge's weight, which dot uses to keep heavy edges
+    // short. Duplicates are found through a hash index over the edges.
+    //
+    // Layout() gives a position to every node that has none, so the output
+    // can be drawn with "neato -n" instead of laid out by dot. Node sizes are
+    // estimated from the labels and fontsize attributes. LAYERED puts nodes
+    // in rows by their distance from the roots, keeps rank groups in one
+    // row, and centers parents over their children. FORCE_DIRECTED runs a
+    // fixed number of Barnes-Hut iterations. Both take O(N log N) time per
+    // pass. Nodes placed by AddNode(object, x, y) keep their position.
+    //
+    // PrintSvg draws a graph whose nodes all have positions as SVG, without
+    // Graphviz. It understands the shape, color, fillcolor, style, penwidth,
+    // fontname, fontsize and fontcolor attributes. Edges are straight lines.
     class Graph
     {
         public:
-            explicit Graph(std::string title_ = "G", bool separate_node_for_each_null_object_ = false)
-                : title{title_}, separate_node_for_each_null_object{separate_node_for_each_null_object_} { }
+            explicit Graph(std::string title_ = "G", bool separate_node_for_each_null_object_ = false,
+                           std::size_t arena_block_size = 64 * 1024)
+                : title{title_}, separate_node_for_each_null_object{separate_node_for_each_null_object_},
+                  arena{arena_block_size}, strings{arena}, tables{attribute_pool},
+                  traversal_order{TraversalOrder::DEPTH_FIRST}, expanding{false},
+                  build_threads{1}, build{nullptr},
+                  max_depth{0}, max_nodes{0}, max_edges{0}, max_output_bytes{0},
+                  expanding_node{nullptr}, frontier{nullptr},
+                  edge_frontier{nullptr}, frontier_count{0},
+                  incremental{false}, refreshing{false}, next_edge_order{0}, removed_count{0}, next_null_node{0},
+                  capture_labels{LabelCapture::NONE}, fields_pending{false},
+                  fold_defaults{false},
+                  duplicate_edges{DuplicateEdges::KEEP} { }
+            Graph(const Graph&) = delete;
+            Graph& operator=(const Graph&) = delete;
+            ~Graph();
 
             template <typename T>
             BaseNode * AddNode(const T* object, std::string var_name = "")
@@ -193,42 +1032,661 @@ namespace CObjectGraph
                 return AddNodeIfNotFound(object, true, x, y, var_name);
             }
 
-            void AddEdge(const void * from, const void * to, std::string label);
+            // Given objects, the nodes are looked up by address and pointee
+            // type. An address with no node of that type, e.g. a Base * to an
+            // object added as a Derived, and void pointers and nullptr are
+            // looked up by address only.
+            template <typename T, typename U>
+            typename std::enable_if< !IsNodePointer<T>::value && !IsNodePointer<U>::value >::type
+            AddEdge(const T* from, const U* to, std::string label)
+            {
+                AddEdge((const void *)from, TypeIdOf<T>(), (const void *)to, TypeIdOf<U>(), label);
+            }
+
+            template <typename T>
+            typename std::enable_if< !IsNodePointer<T>::value >::type
+            AddEdge(const T* from, std::nullptr_t, std::string label)
+            {
+                AddEdge((const void *)from, TypeIdOf<T>(), nullptr, nullptr, label);
+            }
+
+            template <typename U>
+            typename std::enable_if< !IsNodePointer<U>::value >::type
+            AddEdge(std::nullptr_t, const U* to, std::string label)
+            {
+                AddEdge(nullptr, nullptr, (const void *)to, TypeIdOf<U>(), label);
+            }
+
             void AddEdge(const BaseNode * from, const BaseNode * to, std::string label);
             void SetSameRank(const BaseNode * obj1Node, const BaseNode * obj2Node);
-            void SetSameRank(const void* obj1, const void* obj2);
+
+            template <typename T, typename U>
+            typename std::enable_if< !IsNodePointer<T>::value && !IsNodePointer<U>::value >::type
+            SetSameRank(const T* obj1, const U* obj2)
+            {
+                SetSameRank((const void *)obj1, TypeIdOf<T>(), (const void *)obj2, TypeIdOf<U>());
+            }
+
+            template <typename T>
+            typename std::enable_if< !IsNodePointer<T>::value >::type
+            SetSameRank(const T* obj1, std::nullptr_t)
+            {
+                SetSameRank((const void *)obj1, TypeIdOf<T>(), nullptr, nullptr);
+            }
+
+            template <typename U>
+            typename std::enable_if< !IsNodePointer<U>::value >::type
+            SetSameRank(std::nullptr_t, const U* obj2)
+            {
+                SetSameRank(nullptr, nullptr, (const void *)obj2, TypeIdOf<U>());
+            }
+
             void SetAttribute(AttributeScope scope, std::string key, std::string value);
+            void SetTraversalOrder(TraversalOrder order);
+            void SetBuildThreads(unsigned threads);
+            void SetMaxDepth(unsigned depth);
+            void SetMaxNodes(std::size_t count);
+            void SetMaxEdges(std::size_t count);
+            void SetMaxOutputBytes(std::size_t bytes);
+            void SetIncremental(bool enabled);
+            ChangeSet Refresh();
+            void SetCaptureLabels(bool enabled);
+            void SetCaptureLabels(LabelCapture mode);
+            void SetFoldDefaults(bool enabled);
+            void SetDuplicateEdges(DuplicateEdges mode);
+            void Layout(LayoutAlgorithm algorithm = LayoutAlgorithm::LAYERED);
+
+            // Compare two snapshots of the same structure. Nodes are matched
+            // by object address and type; null and frontier nodes by the node
+            // they hang off. Added and changed nodes and added edges are given
+            // by their ids in after, removed ones by their ids in before.
+            // Changed nodes are found by label, so before should have been
+            // built with SetCaptureLabels(true).
+            static ChangeSet Diff(Graph& before, Graph& after);
+            // Prints after, plus what was removed since before, with added,
+            // changed and removed elements colored
+            static void PrintDotDiff(Graph& before, Graph& after, std::ostream& os = std::cout);
             void PrintDot(std::ostream& os = std::cout);
+            void PrintDot(DotWriter& out);
+            void PrintSvg(std::ostream& os = std::cout);
+            void PrintSvg(DotWriter& out);
+            // Writes the compact binary format read by GraphFile
+            void WriteBinary(std::ostream& os);
+            // Hands the graph to an exporter element by element
+            void Export(Exporter& exporter);
+            std::size_t MemoryUsed() const;
 
         private:
             std::string title;
             bool separate_node_for_each_null_object;
-            std::vector< std::unique_ptr< BaseNode > > nodes;
-            std::vector< std::unique_ptr< Edge > > edges;
+            // Nodes and interned strings are allocated from the arena and freed
+            // together when the graph is destroyed.
+            Arena arena;
+            StringPool strings;
+            AttributePool attribute_pool;
+            std::vector< BaseNode * > nodes;
+            std::vector< Edge > edges;
             std::vector< Attribute > attributes;
-            std::vector< std::vector< const BaseNode * > > rankings;
+            // SetSameRank groups as a union-find forest over node indexes (id - 1),
+            // joined by size: rank_parent[i] == i for a root, and rank_size of a
+            // root is its group's size. Nodes never ranked may lie past the end.
+            std::vector< uint32_t > rank_parent;
+            std::vector< uint32_t > rank_size;
+            // The nodes' objects, positions and attribute sets by type, and
+            // their object indexes. slots[id - 1] is where node id's row is,
+            // so passes in id order need not visit the node objects either.
+            struct NodeSlot
+            {
+                uint32_t table;
+                uint32_t row;
+            };
+            NodeTables tables;
+            std::vector< NodeSlot > slots;
+            // Nodes whose related objects have not been added yet. Nodes are
+            // expanded from this work list rather than recursively, so deep
+            // structures do not overflow the stack.
+            TraversalOrder traversal_order;
+            std::deque< BaseNode * > pending;
+            bool expanding;
+            // Parallel build state; build is only set while one is running
+            unsigned build_threads;
+            ParallelBuild * build;
+            std::vector< std::unique_ptr< Arena > > thread_arenas;
+            // Traversal limits and the frontier nodes standing for what they
+            // leave out. frontier belongs to the node being expanded.
+            unsigned max_depth;
+            std::size_t max_nodes;
+            std::size_t max_edges;
+            std::size_t max_output_bytes;
+            BaseNode * expanding_node;
+            FrontierNode * frontier;
+            FrontierNode * edge_frontier;
+            std::size_t frontier_count;
+            std::unordered_set< const void * > deferred_objects;
+            // AddEdge and SetSameRank calls by object made before an endpoint
+            // had a node, with the node whose expansion made them and its
+            // frontier once that expansion was over
+            struct DeferredLink
+            {
+                BaseNode * node;
+                FrontierNode * frontier;
+                const void * from;
+                const void * from_type;
+                const void * to;
+                const void * to_type;
+                std::string label;
+                bool rank;
+            };
+            std::vector< DeferredLink > deferred_links;
+            // Incremental snapshots: records[id - 1] is what the expansion of
+            // node id did; top_level records calls made outside any expansion.
+            struct ExpansionRecord
+            {
+                uint64_t version;
+                std::vector< BaseNode * > children;
+                std::vector< Edge > edges;
+                std::vector< uint64_t > edge_order;     // When each of edges was first added
+                std::vector< std::pair< uint32_t, uint32_t > > ranks;
+            };
+            bool incremental;
+            bool refreshing;
+            std::vector< ExpansionRecord > records;
+            ExpansionRecord top_level;
+            uint64_t next_edge_order;
+            std::vector< BaseNode * > roots;
+            std::size_t removed_count;
+            // Null nodes of the node being expanded again by Refresh. With
+            // separate_node_for_each_null_object they are reused in order
+            // rather than replaced.
+            std::vector< BaseNode * > reusable_null_nodes;
+            std::size_t next_null_node;
+            // The rows of tables[i] before captured_rows[i] have had their
+            // labels captured. fields_pending is set while copied label
+            // fields are unwritten.
+            LabelCapture capture_labels;
+            std::vector< std::size_t > captured_rows;
+            bool fields_pending;
+            bool fold_defaults;
+            // With DuplicateEdges DROP or COUNT, maps each edge to its index
+            // in edges; with COUNT, edge_weights[i] counts edges[i]
+            struct EdgeIndexKey
+            {
+                uint32_t from;
+                uint32_t to;
+                const char * label;     // Interned, so compared by address
+
+                bool operator==(const EdgeIndexKey& other) const
+                {
+                    return from == other.from && to == other.to && label == other.label;
+                }
+            };
+            struct EdgeIndexKeyHash
+            {
+                std::size_t operator()(const EdgeIndexKey& k) const;
+            };
+            DuplicateEdges duplicate_edges;
+            std::unordered_map< EdgeIndexKey, uint32_t, EdgeIndexKeyHash > edge_index;
+            std::vector< uint32_t > edge_weights;
+
+            // Creates the Node<T> for an object, so that the lookup and
+            // traversal logic does not have to live in the AddNode template
+            class NodeFactory
+            {
+                public:
+                    virtual BaseNode * Create(Arena& arena, NodeTable& table, uint32_t id) const = 0;
+
+                protected:
+                    ~NodeFactory() { }
+            };
+
+            template <typename T>
+            class TypedNodeFactory : public NodeFactory
+            {
+                public:
+                    TypedNodeFactory(const T* object_, const std::string& var_name_)
+                        : object(object_), var_name(var_name_) { }
+
+                    BaseNode * Create(Arena& arena, NodeTable& table, uint32_t id) const override
+                    {
+                        if (table.capture_labels == nullptr)
+                            table.capture_labels = &Graph::CaptureTableLabels<T>;
+                        return arena.New< Node<T> >(id, table, object, var_name);
+                    }
+
+                private:
+                    const T* object;
+                    const std::string& var_name;
+            };
 
             template <typename T>
             BaseNode * AddNodeIfNotFound(const T* object, bool set_pos, int x, int y, std::string var_name)
             {
-                BaseNode * node = FindNodeForObject(object);
-                if (node == nullptr || (object == nullptr && separate_node_for_each_null_object))
-                {
-                    Node<T> * new_node = new Node<T>(object, var_name);
-                    nodes.push_back(std::unique_ptr<BaseNode>(new_node));
-                    node = new_node;
+                return AddNodeIfNotFound((const void *)object, &TypeTag<T>::id, TypedNodeFactory<T>(object, var_name),
+                                         set_pos, x, y);
+            }
+
+            BaseNode * AddNodeIfNotFound(const void * object, const void * type, const NodeFactory& factory,
+                                         bool set_pos, int x, int y);
+            void AddEdge(const void * from, const void * from_type, const void * to, const void * to_type,
+                         std::string label);
+            void SetSameRank(const void * obj1, const void * obj1_type, const void * obj2, const void * obj2_type);
+            // The graph's table for the type, for its object index; nullptr
+            // if there is none and add is false. Safe on build threads.
+            NodeTable * IndexTable(const void * type, bool add);
+            const Position& PositionAt(std::size_t i) const
+            {
+                return tables[slots[i].table].positions[slots[i].row];
+            }
+            uint32_t AttributeSetAt(std::size_t i) const
+            {
+                return tables[slots[i].table].attribute_sets[slots[i].row];
+            }
+            // A nullptr type matches the lowest-id node for the address
+            BaseNode * FindNodeForObject(const void * object, const void * type);
+            // FindNodeForObject, falling back to the lowest-id node for the
+            // address if it has none of the type
+            BaseNode * FindNodeForEndpoint(const void * object, const void * type);
+            void IndexNode(const void * object, BaseNode * node);
+            void UnindexNode(BaseNode * node);
+            void AppendNode(BaseNode * node);
+            ExpansionRecord& CurrentRecord();
+            uint64_t NodeVersion(BaseNode * node);
+            void RemoveNode(BaseNode * node, ChangeSet& changes);
+            void RebuildEdgesFromRecords();
+            // Appends e to edges unless it duplicates one that DuplicateEdges
+            // says to merge it into
+            void AppendEdge(const Edge& e);
+            bool IsDuplicateEdge(const Edge& e) const;
+            uint32_t EdgeWeight(std::size_t i) const { return edge_weights.empty() ? 1 : edge_weights[i]; }
+            void JoinRanks(uint32_t id1, uint32_t id2);
+            uint32_t RankRoot(uint32_t index);
+            // The groups of two or more nodes, ordered by their lowest id, as
+            // ids sorted within each group; group g is members[begin[g]..begin[g + 1])
+            void RankGroups(std::vector< uint32_t >& members, std::vector< uint32_t >& begin);
+            // Captures the labels of the nodes added since the last call, or
+            // of all the nodes that have none
+            void CaptureLabels(bool all);
+            template <typename T>
+            static void CaptureTableLabels(Graph& graph, const NodeTable& table, std::size_t begin);
+            // Whether to format count nodes or edges on the build threads
+            bool FormatsInParallel(std::size_t count) const;
+            // Writes out copied label fields, in parallel on the build threads
+            void WriteLabelFields();
+            // The node's value for key, or the graph's ALL_NODES one; nullptr
+            // if neither is set
+            const char * NodeAttribute(const BaseNode * node, const char * key) const;
+            // Estimated size of each node's drawing in points, by node index
+            void MeasureNodes(std::vector< double >& widths, std::vector< double >& heights);
+            void LayoutLayered(const std::vector< double >& widths, const std::vector< double >& heights,
+                               std::vector< double >& x, std::vector< double >& y);
+            void LayoutForceDirected(const std::vector< double >& widths, const std::vector< double >& heights,
+                                     std::vector< double >& x, std::vector< double >& y);
+            // node_styles is indexed by attribute set id
+            void FoldDefaults(DotWriter& out, const AttributeSet * summary, std::vector< std::string >& node_styles,
+                              const char *& edge_label);
+            static void WriteLabel(BaseNode * node, std::ostream& os);
+            static void MatchSnapshots(Graph& before, Graph& after, std::vector< uint32_t >& after_of_before,
+                                       std::vector< uint32_t >& before_of_after, std::vector< bool >& changed);
+            // Diff given the results of MatchSnapshots
+            static ChangeSet DiffMatched(const Graph& before, const Graph& after,
+                                         const std::vector< uint32_t >& after_of_before,
+                                         const std::vector< uint32_t >& before_of_after,
+                                         const std::vector< bool >& changed);
+            bool HasLimits() const;
+            bool AtLimit() const;
+            BaseNode * DeferObject(const void * object);
+            void ExpandPendingNodes();
+            void ResolveDeferredLinks();
+            void SetLinkFrontiers(std::size_t mark);
+            bool LeftObjectsOut() const;
+            void ExpandInParallel(BaseNode * root);
+            void RunBuildWorker(ParallelBuild& build, std::size_t index);
+            void MergeParallelBuild(ParallelBuild& build, BaseNode * root);
+    };
 
-                    if (set_pos)
-                        new_node->SetPosition(x, y);
+    // Binary snapshot format written by Graph::WriteBinary. The header is
+    // followed by the node, edge, rank, rank id and attribute tables and the
+    // string pool, in that order. Integers are in the byte order of the host
+    // that wrote the file. Strings are offsets into the pool, which holds
+    // NUL-terminated strings. Node id n is entry n - 1 of the node table.
+    const uint32_t BINARY_MAGIC = 0x42474F43;     // "COGB" in little endian
+    const uint32_t BINARY_VERSION = 2;
+    const uint32_t BINARY_BYTE_ORDER = 0x01020304;
 
-                    if (object != nullptr)
-                        new_node->AddRelatedObjects(this);
-                }
-                return node;
+    struct BinaryHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t title;
+        uint32_t node_count;
+        uint32_t edge_count;
+        uint32_t rank_count;
+        uint32_t rank_id_count;
+        uint32_t attribute_count;
+        uint32_t graph_attribute_count;     // The graph's come first
+        uint64_t strings_size;
+    };
+
+    enum BinaryNodeFlags : uint32_t
+    {
+        BINARY_NODE_REMOVED = 1,        // A gap left by Graph::Refresh
+        BINARY_NODE_HAS_POSITION = 2
+    };
+
+    struct BinaryNode
+    {
+        uint32_t label;
+        uint32_t flags;
+        int32_t x, y;
+        uint32_t attributes_begin;
+        uint32_t attribute_count;
+    };
+
+    struct BinaryEdge
+    {
+        uint32_t from;
+        uint32_t to;
+        uint32_t label;
+        uint32_t weight;
+    };
+
+    // Ids [begin, begin + count) of the rank id table
+    struct BinaryRank
+    {
+        uint32_t begin;
+        uint32_t count;
+    };
+
+    struct BinaryAttribute
+    {
+        uint32_t key;
+        uint32_t value;
+        uint32_t scope;     // An AttributeScope
+    };
+
+    // Read-only view of a file written by Graph::WriteBinary. The file is
+    // memory-mapped and the tables point into the mapping, so opening even a
+    // large snapshot copies nothing.
+    class GraphFile
+    {
+        public:
+            explicit GraphFile(const std::string& path);
+            GraphFile(const GraphFile&) = delete;
+            GraphFile& operator=(const GraphFile&) = delete;
+            ~GraphFile();
+
+            const char * Title() const { return String(header->title); }
+            uint32_t NodeCount() const { return header->node_count; }
+            const BinaryNode * Nodes() const { return nodes; }
+            uint32_t EdgeCount() const { return header->edge_count; }
+            const BinaryEdge * Edges() const { return edges; }
+            uint32_t RankCount() const { return header->rank_count; }
+            const BinaryRank * Ranks() const { return ranks; }
+            const uint32_t * RankIds() const { return rank_ids; }
+            uint32_t AttributeCount() const { return header->attribute_count; }
+            const BinaryAttribute * Attributes() const { return attributes; }
+            const char * String(uint32_t offset) const;
+
+            // Prints the graph as Graph::PrintDot did
+            void PrintDot(std::ostream& os = std::cout) const;
+            void PrintDot(DotWriter& out) const;
+            void Export(Exporter& exporter) const;
+
+        private:
+            void * data;
+            std::size_t size;
+            const BinaryHeader * header;
+            const BinaryNode * nodes;
+            const BinaryEdge * edges;
+            const BinaryRank * ranks;
+            const uint32_t * rank_ids;
+            const BinaryAttribute * attributes;
+            const char * strings;
+
+            void CheckId(uint32_t id) const;
+    };
+
+    // Receives a graph one element at a time, from Graph::Export or
+    // GraphFile::Export: Begin, the nodes, the rank groups, the edges, then
+    // End. Exporters write each element as it arrives and keep no copy of
+    // the graph, so exports run in constant memory.
+    //
+    // An exporter that formats each node and edge on its own can return true
+    // from FormatsInParallel. Graph::Export with several build threads then
+    // has runs of nodes and edges formatted by FormatNode and FormatEdge on
+    // different threads at once, each run into a buffer of its own, and
+    // hands the buffers to WriteFormattedNodes and WriteFormattedEdges in
+    // order, in place of WriteNode and WriteEdge.
+    class Exporter
+    {
+        public:
+            // node_keys lists the keys of the node-specific attributes
+            virtual void Begin(const std::string& title, const std::vector<Attribute>& attributes,
+                               const std::vector<std::string>& node_keys) = 0;
+            virtual void WriteNode(uint32_t id, const std::string& label, const Position& pos,
+                                   const std::vector<Attribute>& attributes) = 0;
+            virtual void WriteRank(const std::vector<uint32_t>& ids) { }
+            // weight counts merged duplicates (see DuplicateEdges); it is 1
+            // for an edge that had none
+            virtual void WriteEdge(uint32_t from, uint32_t to, const char * label, uint32_t weight) = 0;
+            virtual void End() = 0;
+            virtual ~Exporter() { }
+
+            virtual bool FormatsInParallel() const { return false; }
+            virtual void FormatNode(DotWriter& out, uint32_t id, const std::string& label, const Position& pos,
+                                    const std::vector<Attribute>& attributes) const { }
+            virtual void FormatEdge(DotWriter& out, uint32_t from, uint32_t to, const char * label,
+                                    uint32_t weight) const { }
+            virtual void WriteFormattedNodes(const char * text, std::size_t n) { }
+            virtual void WriteFormattedEdges(const char * text, std::size_t n) { }
+    };
+
+    // One JSON object per line: the graph, then each node, rank group and
+    // edge, told apart by their "type" field
+    class JsonLinesExporter : public Exporter
+    {
+        public:
+            explicit JsonLinesExporter(std::ostream& os) : out{os} { }
+
+            void Begin(const std::string& title, const std::vector<Attribute>& attributes,
+                       const std::vector<std::string>& node_keys) override;
+            void WriteNode(uint32_t id, const std::string& label, const Position& pos,
+                           const std::vector<Attribute>& attributes) override
+            {
+                FormatNode(out, id, label, pos, attributes);
+            }
+            void WriteRank(const std::vector<uint32_t>& ids) override;
+            void WriteEdge(uint32_t from, uint32_t to, const char * label, uint32_t weight) override
+            {
+                FormatEdge(out, from, to, label, weight);
             }
+            void End() override { out.Flush(); }
+
+            bool FormatsInParallel() const override { return true; }
+            void FormatNode(DotWriter& out, uint32_t id, const std::string& label, const Position& pos,
+                            const std::vector<Attribute>& attributes) const override;
+            void FormatEdge(DotWriter& out, uint32_t from, uint32_t to, const char * label,
+                            uint32_t weight) const override;
+            void WriteFormattedNodes(const char * text, std::size_t n) override { out.Write(text, n); }
+            void WriteFormattedEdges(const char * text, std::size_t n) override { out.Write(text, n); }
 
-            BaseNode * FindNodeForObject(const void * object);
+        private:
+            DotWriter out;
+
+            static void WriteString(DotWriter& out, const char * s);
+            static void WriteAttributes(DotWriter& out, const std::vector<Attribute>& attributes,
+                                        AttributeScope scope);
     };
+
+    // GraphML, with the label, position and node attributes as data keys.
+    // Graph-wide node and edge attributes become the keys' defaults. GraphML
+    // has no rank groups, so those are left out.
+    class GraphMLExporter : public Exporter
+    {
+        public:
+            explicit GraphMLExporter(std::ostream& os) : out{os} { }
+
+            void Begin(const std::string& title, const std::vector<Attribute>& attributes,
+                       const std::vector<std::string>& node_keys) override;
+            void WriteNode(uint32_t id, const std::string& label, const Position& pos,
+                           const std::vector<Attribute>& attributes) override
+            {
+                FormatNode(out, id, label, pos, attributes);
+            }
+            void WriteEdge(uint32_t from, uint32_t to, const char * label, uint32_t weight) override
+            {
+                FormatEdge(out, from, to, label, weight);
+            }
+            void End() override;
+
+            bool FormatsInParallel() const override { return true; }
+            void FormatNode(DotWriter& out, uint32_t id, const std::string& label, const Position& pos,
+                            const std::vector<Attribute>& attributes) const override;
+            void FormatEdge(DotWriter& out, uint32_t from, uint32_t to, const char * label,
+                            uint32_t weight) const override;
+            void WriteFormattedNodes(const char * text, std::size_t n) override { out.Write(text, n); }
+            void WriteFormattedEdges(const char * text, std::size_t n) override { out.Write(text, n); }
+
+        private:
+            DotWriter out;
+            std::vector<std::string> keys;   // Node attribute key i is "a<i>"
+
+            static void WriteEscaped(DotWriter& out, const char * s);
+    };
+
+    // Two CSV tables: nodes as id,label,x,y,attributes, with the attributes
+    // as key=value pairs separated by ';', and edges as from,to,label,weight
+    class CsvExporter : public Exporter
+    {
+        public:
+            CsvExporter(std::ostream& nodes_os, std::ostream& edges_os) : nodes{nodes_os}, edges{edges_os} { }
+
+            void Begin(const std::string& title, const std::vector<Attribute>& attributes,
+                       const std::vector<std::string>& node_keys) override;
+            void WriteNode(uint32_t id, const std::string& label, const Position& pos,
+                           const std::vector<Attribute>& attributes) override
+            {
+                FormatNode(nodes, id, label, pos, attributes);
+            }
+            void WriteEdge(uint32_t from, uint32_t to, const char * label, uint32_t weight) override
+            {
+                FormatEdge(edges, from, to, label, weight);
+            }
+            void End() override;
+
+            bool FormatsInParallel() const override { return true; }
+            void FormatNode(DotWriter& out, uint32_t id, const std::string& label, const Position& pos,
+                            const std::vector<Attribute>& attributes) const override;
+            void FormatEdge(DotWriter& out, uint32_t from, uint32_t to, const char * label,
+                            uint32_t weight) const override;
+            void WriteFormattedNodes(const char * text, std::size_t n) override { nodes.Write(text, n); }
+            void WriteFormattedEdges(const char * text, std::size_t n) override { edges.Write(text, n); }
+
+        private:
+            DotWriter nodes;
+            DotWriter edges;
+
+            static void WriteField(DotWriter& out, const char * s, std::size_t n);
+    };
+
+    // Prints graphs in the background, so the thread that built a graph only
+    // pays for the traversal and can go on to build the next one. A thread
+    // of the writer's own formats each graph into one buffer while another
+    // writes the other buffer to the target, and the buffers are then
+    // swapped. Graphs are printed one at a time, in the order they were
+    // handed over, and destroyed once printed. The future is ready once the
+    // output is written, or holds the exception that stopped it; a file may
+    // then be left incomplete. Labels not captured are written from the
+    // objects while printing, so graphs of objects that change or are freed
+    // meanwhile should be built with SetCaptureLabels.
+    class SnapshotWriter
+    {
+        public:
+            explicit SnapshotWriter(std::size_t buffer_size = 1024 * 1024);
+            SnapshotWriter(const SnapshotWriter&) = delete;
+            SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+            // Waits for the graphs handed over so far to be printed
+            ~SnapshotWriter();
+
+            // os must stay valid until the future is ready
+            std::future<void> PrintDot(std::unique_ptr<Graph> graph, std::ostream& os);
+            // The file is created or truncated on the writing thread
+            std::future<void> PrintDot(std::unique_ptr<Graph> graph, const std::string& path);
+
+        private:
+            struct Job;
+            class Worker;
+            std::unique_ptr<Worker> worker;
+    };
+
+    template <typename T>
+    template <typename U>
+    void FieldExpander<T>::operator()(const EdgeField<T, U>& field)
+    {
+        BaseNode * related = graph->AddNode((const typename std::remove_const<U>::type *)(object->*field.member));
+        graph->AddEdge(node, related, field.name);
+        if (field.same_rank)
+            graph->SetSameRank(node, related);
+    }
+
+    // Labels of many nodes are written to one stream. This puts back the
+    // format a label writer may change, e.g. with std::hex, so that it does
+    // not carry over to the labels written after it.
+    class LabelFormatGuard
+    {
+        public:
+            explicit LabelFormatGuard(std::ostream& os_)
+                : os(os_), flags{os_.flags()}, fill{os_.fill()}, width{os_.width()}, precision{os_.precision()} { }
+            ~LabelFormatGuard()
+            {
+                os.flags(flags);
+                os.fill(fill);
+                os.width(width);
+                os.precision(precision);
+            }
+
+        private:
+            std::ostream& os;
+            std::ios_base::fmtflags flags;
+            char fill;
+            std::streamsize width;
+            std::streamsize precision;
+    };
+
+    // Runs over the rows of one type, so the label code of Node<T> is called
+    // directly rather than through each node's virtual functions, and the
+    // code generated from a COG_DESCRIBE_NODE list is inlined into the loop
+    template <typename T>
+    void Graph::CaptureTableLabels(Graph& graph, const NodeTable& table, std::size_t begin)
+    {
+        // Null labels do not depend on the objects
+        std::ostringstream oss;
+        for (std::size_t row = begin; row < table.Size(); row++)
+        {
+            if (table.ids[row] == 0 || table.objects[row] == nullptr)
+                continue;
+            Node<T> * node = static_cast< Node<T> * >(graph.nodes[table.ids[row] - 1]);
+            if (node->label != nullptr)
+                continue;
+            if (graph.capture_labels == LabelCapture::FIELDS)
+            {
+                node->label = node->Node<T>::CopyLabelFields(graph.arena, graph.strings);
+                if (node->label != nullptr)
+                {
+                    node->label_is_fields = true;
+                    graph.fields_pending = true;
+                    continue;
+                }
+            }
+            oss.str("");
+            {
+                LabelFormatGuard guard(oss);
+                node->Node<T>::WriteLabel(oss);
+            }
+            node->label = graph.strings.Intern(oss.str());
+        }
+    }
 }
 
 
@@ -239,14 +1697,37 @@ template <> const char* CObjectGraph::Node<T>::type_name = #T;
 template <> void CObjectGraph::Node<T>::SetNodeAttributes()
 
 #define COG_WRITE_NODE_LABEL(T) \
-template <> void CObjectGraph::Node<T>::WriteNodeLabel(std::ostringstream& oss)
+template <> void CObjectGraph::Node<T>::WriteNodeLabel(std::ostream& oss)
 
 #define COG_WRITE_NULL_NODE_LABEL(T) \
-template <> void CObjectGraph::Node<T>::WriteNullNodeLabel(std::ostringstream& oss)
+template <> void CObjectGraph::Node<T>::WriteNullNodeLabel(std::ostream& oss)
 
 #define COG_ADD_RELATED_OBJECTS(T) \
 template <> void CObjectGraph::Node<T>::AddRelatedObjects(CObjectGraph::Graph * graph)
 
+#define COG_OBJECT_VERSION(T) \
+template <> uint64_t CObjectGraph::Node<T>::ObjectVersion()
+
+// Declares the fields of T in place of COG_DEFINE_NODE, COG_WRITE_NODE_LABEL
+// and COG_ADD_RELATED_OBJECTS, e.g.
+//     COG_DESCRIBE_NODE(ListNode, COG_LABEL(str), COG_LABEL(x), COG_RANKED_EDGE(next));
+// The label and traversal code is generated from the list. Like the other
+// macros it is used inside namespace CObjectGraph, and they can still be used
+// for T's attributes, version or null label.
+#define COG_DESCRIBE_NODE(T, ...) \
+template <> const char* CObjectGraph::Node<T>::type_name = #T; \
+template <> struct NodeFields<T> \
+{ \
+    typedef T Type; \
+    static const bool described = true; \
+    template <typename Visitor> \
+    static void Visit(Visitor& visitor) { CObjectGraph::VisitFields(visitor, __VA_ARGS__); } \
+}
+
+#define COG_LABEL(field) CObjectGraph::MakeLabelField(#field, &Type::field)
+#define COG_EDGE(field) CObjectGraph::MakeEdgeField(#field, &Type::field, false)
+#define COG_RANKED_EDGE(field) CObjectGraph::MakeEdgeField(#field, &Type::field, true)
+
 
 
 #endif
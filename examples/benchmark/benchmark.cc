@@ -0,0 +1,405 @@
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <future>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include "cobjectgraph.h"
+#include "list.h"
+
+using namespace std;
+using namespace CObjectGraph;
+
+namespace CObjectGraph {
+
+    COG_DESCRIBE_NODE(ListNode, COG_LABEL(str), COG_LABEL(x), COG_EDGE(next));
+}
+
+struct TreeNode
+{
+    int value;
+    TreeNode * left;
+    TreeNode * right;
+};
+
+namespace CObjectGraph {
+
+    COG_DEFINE_NODE(TreeNode);
+
+    COG_WRITE_NODE_LABEL(TreeNode)
+    {
+        oss << object->value;
+    }
+
+    COG_ADD_RELATED_OBJECTS(TreeNode)
+    {
+        graph->AddEdge(this, graph->AddNode(object->left), "left");
+        graph->AddEdge(this, graph->AddNode(object->right), "right");
+    }
+
+    COG_SET_NODE_ATTRIBUTES(TreeNode)
+    {
+        if (object != nullptr && object->value % 3 == 0)
+            SetAttribute("color", "blue");
+    }
+}
+
+// Its label leaves the stream in hex, which must not change how the next
+// node's label is written
+struct CounterNode
+{
+    int count;
+    CounterNode * next;
+};
+
+namespace CObjectGraph {
+
+    COG_DEFINE_NODE(CounterNode);
+
+    COG_WRITE_NODE_LABEL(CounterNode)
+    {
+        oss << object->count << " = 0x" << hex << object->count;
+    }
+
+    COG_ADD_RELATED_OBJECTS(CounterNode)
+    {
+        graph->AddEdge(this, graph->AddNode(object->next), "next");
+    }
+}
+
+class Timer
+{
+    public:
+        Timer() : start{chrono::steady_clock::now()} { }
+        double Elapsed() const
+        {
+            return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        }
+
+    private:
+        chrono::steady_clock::time_point start;
+};
+
+class NullBuffer : public streambuf
+{
+    protected:
+        int overflow(int c) override { return c; }
+        streamsize xsputn(const char *, streamsize n) override { return n; }
+};
+
+static double FileSize(const char * path)
+{
+    ifstream file(path, ios::binary | ios::ate);
+    return (double) file.tellg();
+}
+
+// PrintDot to a file, plain and gzip-compressed at a few levels
+static void BenchmarkCompression(Graph& g, int n)
+{
+    const char * path = "benchmark.dot";
+    Timer plain_timer;
+    {
+        ofstream file(path, ios::binary);
+        g.PrintDot(file);
+    }
+    double plain_ms = plain_timer.Elapsed();
+    cout << "dot n=" << n << "  plain: " << plain_ms << " ms  "
+         << FileSize(path) / n << " bytes/node\n";
+
+#ifdef COG_WITH_ZLIB
+    for (int level : {1, 6, 9})
+    {
+        Timer gzip_timer;
+        {
+            ofstream file(path, ios::binary);
+            GzipOstream gzip(file, level);
+            g.PrintDot(gzip);
+            gzip.Close();
+        }
+        double gzip_ms = gzip_timer.Elapsed();
+        cout << "dot n=" << n << "  gzip -" << level << ": " << gzip_ms << " ms  "
+             << FileSize(path) / n << " bytes/node\n";
+    }
+#endif
+    remove(path);
+}
+
+static void BenchmarkList(int n)
+{
+    LinkedList list;
+    for (int i = 0; i < n; i++)
+        list.AddToTail("element", i);
+
+    Timer build_timer;
+    Graph g;
+    g.AddNode(list.head);
+    double build_ms = build_timer.Elapsed();
+
+    NullBuffer null_buffer;
+    ostream null_stream(&null_buffer);
+    Timer print_timer;
+    g.PrintDot(null_stream);
+    double print_ms = print_timer.Elapsed();
+
+    cout << "list n=" << n
+         << "  build: " << build_ms << " ms"
+         << "  print: " << print_ms << " ms"
+         << "  memory: " << (double) g.MemoryUsed() / n << " bytes/node\n";
+
+    // Binary snapshot: size against DOT, and how long loading it takes
+    ostringstream dot;
+    g.PrintDot(dot);
+    const char * path = "benchmark.cogb";
+    Timer write_timer;
+    {
+        ofstream file(path, ios::binary);
+        g.WriteBinary(file);
+    }
+    double write_ms = write_timer.Elapsed();
+    double binary_size = FileSize(path);
+
+    Timer load_timer;
+    GraphFile file(path);
+    uint32_t loaded = file.NodeCount();
+    double load_ms = load_timer.Elapsed();
+    remove(path);
+
+    cout << "list n=" << loaded
+         << "  dot: " << (double) dot.str().size() / n << " bytes/node"
+         << "  binary: " << binary_size / n << " bytes/node"
+         << "  write: " << write_ms << " ms"
+         << "  load: " << load_ms << " ms\n";
+
+    BenchmarkCompression(g, n);
+}
+
+static void BenchmarkTree(int n, unsigned threads)
+{
+    // Complete binary tree stored in heap order
+    vector<TreeNode> tree(n);
+    for (int i = 0; i < n; i++)
+    {
+        tree[i].value = i;
+        tree[i].left = (2 * i + 1 < n) ? &tree[2 * i + 1] : nullptr;
+        tree[i].right = (2 * i + 2 < n) ? &tree[2 * i + 2] : nullptr;
+    }
+
+    Timer build_timer;
+    Graph g;
+    g.SetBuildThreads(threads);
+    g.AddNode(&tree[0]);
+    double build_ms = build_timer.Elapsed();
+
+    cout << "tree n=" << n << " threads=" << threads
+         << "  build: " << build_ms << " ms\n";
+}
+
+// The graphs built on several threads must print the same as serial ones
+static bool CheckParallelBuild(int n, unsigned threads)
+{
+    vector<TreeNode> tree(n);
+    for (int i = 0; i < n; i++)
+    {
+        tree[i].value = i;
+        tree[i].left = (2 * i + 1 < n) ? &tree[2 * i + 1] : nullptr;
+        tree[i].right = (2 * i + 2 < n) ? &tree[2 * i + 2] : nullptr;
+    }
+    LinkedList list;
+    for (int i = 0; i < n; i++)
+        list.AddToTail("element", i);
+    vector<CounterNode> counters(n);
+    for (int i = 0; i < n; i++)
+        counters[i] = CounterNode { i, (i + 1 < n) ? &counters[i + 1] : nullptr };
+
+    // Printed and exported, on the build threads for the second graph
+    string output[2];
+    for (int k = 0; k < 2; k++)
+    {
+        Graph g;
+        g.SetBuildThreads(k == 0 ? 1 : threads);
+        g.AddNode(&tree[0], "tree");
+        g.AddNode(list.head, "list");
+        g.AddNode(&counters[0], "counters");
+        ostringstream oss;
+        g.PrintDot(oss);
+        {
+            JsonLinesExporter exporter(oss);
+            g.Export(exporter);
+        }
+        output[k] = oss.str();
+    }
+
+    bool same = (output[0] == output[1]) && output[0].find("\"100 = 0x64\"") != string::npos;
+    cout << "parallel build n=" << n << " threads=" << threads
+         << "  output " << (same ? "matches" : "DIFFERS FROM") << " the serial build\n";
+    return same;
+}
+
+// Whole-graph passes over a large graph: lookup, layout and each output
+// format
+static void BenchmarkPasses(int n, unsigned threads)
+{
+    vector<TreeNode> tree(n);
+    for (int i = 0; i < n; i++)
+    {
+        tree[i].value = i;
+        tree[i].left = (2 * i + 1 < n) ? &tree[2 * i + 1] : nullptr;
+        tree[i].right = (2 * i + 2 < n) ? &tree[2 * i + 2] : nullptr;
+    }
+    Graph g;
+    g.SetCaptureLabels(true);
+    g.AddNode(&tree[0]);
+
+    NullBuffer null_buffer;
+    ostream null_stream(&null_buffer);
+    auto report = [n] (const char * pass, double ms) {
+        cout << "passes n=" << n << "  " << pass << ": " << ms << " ms  " << ms * 1e6 / n << " ns/node\n";
+    };
+
+    // Every object again: AddNode only looks up the node it already has
+    Timer lookup_timer;
+    for (int i = 0; i < n; i++)
+        g.AddNode(&tree[i]);
+    report("lookup", lookup_timer.Elapsed());
+
+    Timer layout_timer;
+    g.Layout();
+    report("layout", layout_timer.Elapsed());
+
+    Timer print_timer;
+    g.PrintDot(null_stream);
+    report("print", print_timer.Elapsed());
+
+    g.SetFoldDefaults(true);
+    Timer fold_timer;
+    g.PrintDot(null_stream);
+    report("print folded", fold_timer.Elapsed());
+
+    Timer export_timer;
+    {
+        JsonLinesExporter exporter(null_stream);
+        g.Export(exporter);
+    }
+    report("export", export_timer.Elapsed());
+
+    Timer binary_timer;
+    g.WriteBinary(null_stream);
+    report("binary", binary_timer.Elapsed());
+
+    // The same output, formatted on the build threads
+    if (threads > 1)
+    {
+        g.SetBuildThreads(threads);
+        g.SetFoldDefaults(false);
+        Timer parallel_print_timer;
+        g.PrintDot(null_stream);
+        report("print on build threads", parallel_print_timer.Elapsed());
+
+        Timer parallel_export_timer;
+        {
+            JsonLinesExporter exporter(null_stream);
+            g.Export(exporter);
+        }
+        report("export on build threads", parallel_export_timer.Elapsed());
+    }
+}
+
+// How long the list must stay put while labels are captured, and what the
+// first print costs after
+static void BenchmarkCapture(int n, unsigned threads, LabelCapture mode, const char * name)
+{
+    LinkedList list;
+    for (int i = 0; i < n; i++)
+        list.AddToTail("element", i);
+
+    Timer build_timer;
+    Graph g;
+    g.SetBuildThreads(threads);
+    g.SetCaptureLabels(mode);
+    g.AddNode(list.head);
+    double build_ms = build_timer.Elapsed();
+
+    NullBuffer null_buffer;
+    ostream null_stream(&null_buffer);
+    Timer print_timer;
+    g.PrintDot(null_stream);
+    double print_ms = print_timer.Elapsed();
+
+    cout << "capture " << name << " n=" << n << " threads=" << threads
+         << "  build: " << build_ms << " ms"
+         << "  first print: " << print_ms << " ms\n";
+}
+
+// Time the building thread spends per snapshot written to a file: building
+// and printing it, or building it and handing it to a SnapshotWriter
+static void BenchmarkSnapshots(int n, int count)
+{
+    vector<TreeNode> tree(n);
+    for (int i = 0; i < n; i++)
+    {
+        tree[i].value = i;
+        tree[i].left = (2 * i + 1 < n) ? &tree[2 * i + 1] : nullptr;
+        tree[i].right = (2 * i + 2 < n) ? &tree[2 * i + 2] : nullptr;
+    }
+    const char * path = "benchmark.dot";
+
+    Timer sync_timer;
+    for (int k = 0; k < count; k++)
+    {
+        Graph g;
+        g.SetCaptureLabels(true);
+        g.AddNode(&tree[0]);
+        ofstream file(path);
+        g.PrintDot(file);
+    }
+    double sync_ms = sync_timer.Elapsed() / count;
+
+    double async_ms = 0;
+    Timer total_timer;
+    {
+        SnapshotWriter writer;
+        vector< future<void> > written;
+        for (int k = 0; k < count; k++)
+        {
+            Timer request_timer;
+            unique_ptr<Graph> g(new Graph());
+            g->SetCaptureLabels(true);
+            g->AddNode(&tree[0]);
+            written.push_back(writer.PrintDot(std::move(g), string(path)));
+            async_ms += request_timer.Elapsed();
+        }
+        for (auto& w : written)
+            w.get();
+    }
+    double total_ms = total_timer.Elapsed() / count;
+    remove(path);
+
+    cout << "snapshots n=" << n << "  print: " << sync_ms << " ms/snapshot"
+         << "  background: " << async_ms / count << " ms/snapshot on the building thread, "
+         << total_ms << " ms/snapshot in all\n";
+}
+
+int main(int argc, char* argv[])
+{
+    int n = (argc > 1) ? atoi(argv[1]) : 20000;
+    unsigned threads = (argc > 2) ? atoi(argv[2]) : thread::hardware_concurrency();
+    int passes_n = (argc > 3) ? atoi(argv[3]) : 1000000;
+    BenchmarkList(n);
+    BenchmarkTree(n, 1);
+    if (threads > 1)
+    {
+        BenchmarkTree(n, threads);
+        if (!CheckParallelBuild(n, threads))
+            return 1;
+    }
+    BenchmarkCapture(n, threads, LabelCapture::TEXT, "text");
+    BenchmarkCapture(n, threads, LabelCapture::FIELDS, "fields");
+    BenchmarkSnapshots(n, 5);
+    if (passes_n > 0)
+        BenchmarkPasses(passes_n, threads);
+    return 0;
+}
@@ -0,0 +1 @@
+../../cobjectgraph.cc
\ No newline at end of file
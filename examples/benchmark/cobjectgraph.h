@@ -0,0 +1 @@
+../../cobjectgraph.h
\ No newline at end of file
@@ -0,0 +1 @@
+../linked_list/list.h
\ No newline at end of file
@@ -0,0 +1,65 @@
+// Converts a graph saved with Graph::WriteBinary to DOT, or with -f to
+// JSON Lines, GraphML or CSV. CSV goes to <graph-file>.nodes.csv and
+// <graph-file>.edges.csv.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include "cobjectgraph.h"
+
+using namespace std;
+using namespace CObjectGraph;
+
+int main(int argc, char* argv[])
+{
+    string format = "dot";
+    int arg = 1;
+    if (argc == 4 && strcmp(argv[1], "-f") == 0)
+    {
+        format = argv[2];
+        arg = 3;
+    }
+    if (arg != argc - 1)
+    {
+        cerr << "usage: " << argv[0] << " [-f dot|jsonl|graphml|csv] graph-file\n";
+        return 2;
+    }
+    try
+    {
+        GraphFile file(argv[arg]);
+        if (format == "dot")
+        {
+            file.PrintDot();
+        }
+        else if (format == "jsonl")
+        {
+            JsonLinesExporter exporter(cout);
+            file.Export(exporter);
+        }
+        else if (format == "graphml")
+        {
+            GraphMLExporter exporter(cout);
+            file.Export(exporter);
+        }
+        else if (format == "csv")
+        {
+            ofstream nodes(string(argv[arg]) + ".nodes.csv");
+            ofstream edges(string(argv[arg]) + ".edges.csv");
+            CsvExporter exporter(nodes, edges);
+            file.Export(exporter);
+        }
+        else
+        {
+            cerr << "unknown format " << format << '\n';
+            return 2;
+        }
+    }
+    catch (const exception& e)
+    {
+        cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
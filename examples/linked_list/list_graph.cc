@@ -7,20 +7,7 @@ using namespace CObjectGraph;
 
 namespace CObjectGraph {
 
-    COG_DEFINE_NODE(ListNode);
-
-    COG_WRITE_NODE_LABEL(ListNode)
-    {
-        oss << "str: '" << object->str << "'\\l";
-        oss << "x: " << object->x << "\\l";
-    }
-
-    COG_ADD_RELATED_OBJECTS(ListNode)
-    {
-        auto next_node = graph->AddNode(object->next);
-        graph->AddEdge(this, next_node, "next");
-        graph->SetSameRank(this, next_node);
-    }
+    COG_DESCRIBE_NODE(ListNode, COG_LABEL(str), COG_LABEL(x), COG_RANKED_EDGE(next));
 
     COG_SET_NODE_ATTRIBUTES(ListNode)
     {
@@ -54,6 +41,7 @@ int main()
     list.AddToHead("Phoenix", 110);
     list.AddToHead("Flagstaff", 85);
     list.AddToTail("Los Angeles", 90);
+    list.AddToTail("Santa Fe \"The City Different\"", 75);
 
     Graph g("", true);
 